@@ -40,6 +40,7 @@
 #include "fred.h"
 #include "cpuinfo.h"
 #include "timer.h"
+#include "perfcounters.h"
 
 // This class just holds arguments to each thread.
 class workerArg {
@@ -51,13 +52,15 @@ public:
     : _object (obj),
       _objSize (objSize),
       _iterations (iterations),
-      _repetitions (repetitions)
+      _repetitions (repetitions),
+      _counters (NULL)
   {}
 
   char * _object;
   int _objSize;
   int _iterations;
   int _repetitions;
+  PerfValues * _counters; // Where to put the thread's event counts, if counting
 };
 
 
@@ -75,6 +78,15 @@ extern "C" void * worker (void * arg)
   workerArg * w = (workerArg *) arg;
   delete w->_object;
   workerArg w1 = *w;
+
+  // Count events over the measured loop only
+  PerfCounters counters;
+  bool measure = w1._counters != NULL;
+  if (measure) {
+    perf_counters_open (&counters);
+    perf_counters_start (&counters);
+  }
+
   for (int i = 0; i < w1._iterations; i++) {
     // Allocate the object.
     char * obj = new char[w1._objSize];
@@ -90,6 +102,12 @@ extern "C" void * worker (void * arg)
     delete [] obj;
   }
 
+  if (measure) {
+    perf_counters_stop (&counters);
+    perf_counters_read (&counters, w1._counters);
+    perf_counters_close (&counters);
+  }
+
 #if !defined(_WIN32)
   return NULL;
 #endif
@@ -126,11 +144,15 @@ int main (int argc, char * argv[])
     objs[i] = new char[objSize];
   }
 
+  // With PERF_COUNTERS set, each thread counts hardware events over its loop
+  PerfValues * counters = perf_counters_requested() ? new PerfValues[nthreads] : NULL;
+
   HL::Timer t;
   t.start();
 
   for (i = 0; i < nthreads; i++) {
     w[i] = workerArg (objs[i], objSize, repetitions / nthreads, iterations);
+    w[i]._counters = counters ? &counters[i] : NULL;
     threads[i].create (&worker, (void *) &w[i]);
   }
   for (i = 0; i < nthreads; i++) {
@@ -143,5 +165,9 @@ int main (int argc, char * argv[])
   delete [] w;
 
   printf ("Time elapsed = %f seconds.\n", (double) t);
+  if (counters) {
+    perf_values_report (stdout, counters, nthreads);
+    delete [] counters;
+  }
   return 0;
 }
@@ -41,6 +41,7 @@ using namespace std;
 #include "cpuinfo.h"
 #include "fred.h"
 #include "timer.h"
+#include "perfcounters.h"
 
 // This class just holds arguments to each thread.
 class workerArg {
@@ -49,12 +50,14 @@ public:
   workerArg (int objSize, int repetitions, int iterations)
     : _objSize (objSize),
       _iterations (iterations),
-      _repetitions (repetitions)
+      _repetitions (repetitions),
+      _counters (NULL)
   {}
 
   int _objSize;
   int _iterations;
   int _repetitions;
+  PerfValues * _counters; // Where to put the thread's event counts, if counting
 };
 
 
@@ -70,6 +73,15 @@ extern "C" void * worker (void * arg)
   //   then free it.
   workerArg * w = (workerArg *) arg;
   workerArg w1 = *w;
+
+  // Count events over the measured loop only
+  PerfCounters counters;
+  bool measure = w1._counters != NULL;
+  if (measure) {
+    perf_counters_open (&counters);
+    perf_counters_start (&counters);
+  }
+
   for (int i = 0; i < w1._iterations; i++) {
     // Allocate the object.
     char * obj = new char[w1._objSize];
@@ -90,6 +102,12 @@ extern "C" void * worker (void * arg)
     // Free the object.
     delete [] obj;
   }
+
+  if (measure) {
+    perf_counters_stop (&counters);
+    perf_counters_read (&counters, w1._counters);
+    perf_counters_close (&counters);
+  }
 #if !defined(_WIN32)
   return NULL;
 #endif
@@ -118,6 +136,9 @@ int main (int argc, char * argv[])
     
   int i;
   
+  // With PERF_COUNTERS set, each thread counts hardware events over its loop
+  PerfValues * counters = perf_counters_requested() ? new PerfValues[nthreads] : NULL;
+
   HL::Timer t;
   t.start();
   
@@ -125,6 +146,7 @@ int main (int argc, char * argv[])
     
   for (i = 0; i < nthreads; i++) {
     w[i] = workerArg (objSize, repetitions / nthreads, iterations);
+    w[i]._counters = counters ? &counters[i] : NULL;
     threads[i].create (&worker, (void *) &w[i]);
   }
   for (i = 0; i < nthreads; i++) {
@@ -136,4 +158,8 @@ int main (int argc, char * argv[])
   delete [] w;
 
   cout << "Time elapsed = " << (double) t << " seconds." << endl;
+  if (counters) {
+    perf_values_report (stdout, counters, nthreads);
+    delete [] counters;
+  }
 }
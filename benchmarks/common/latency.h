@@ -0,0 +1,110 @@
+/*
+ * latency.h
+ *
+ * Cycle-counter timing and latency histograms for the C benchmarks. Times
+ * are kept in ticks of the time stamp counter (nanoseconds where there is
+ * none) and converted with tick_ns() when reported. Histogram buckets are
+ * log-linear: exact below 16 ticks, then 16 per power of two, so a
+ * percentile is within about 6% of the true value.
+ */
+
+#ifndef BENCHMARKS_LATENCY_H
+#define BENCHMARKS_LATENCY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define LG_SUB_BUCKETS 4
+#define NUM_BUCKETS (64 << LG_SUB_BUCKETS)
+
+typedef struct histogram {
+    uint64_t counts[NUM_BUCKETS];
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+
+static inline uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// Nanoseconds per tick, measured over 50 ms
+static inline double tick_ns() {
+    struct timespec start, end, pause = { 0, 50000000 };
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t start_ticks = ticks();
+    nanosleep(&pause, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t elapsed_ticks = ticks() - start_ticks;
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / (double) elapsed_ticks;
+}
+
+static inline int histogram_bucket(uint64_t t) {
+    if (t < (1 << LG_SUB_BUCKETS))
+        return (int) t;
+    int shift = 63 - __builtin_clzll(t) - LG_SUB_BUCKETS;
+    return ((shift + 1) << LG_SUB_BUCKETS) + (int) ((t >> shift) & ((1 << LG_SUB_BUCKETS) - 1));
+}
+
+// Smallest value in a bucket
+static inline uint64_t histogram_bucket_value(int b) {
+    if (b < (1 << LG_SUB_BUCKETS))
+        return b;
+    int shift = (b >> LG_SUB_BUCKETS) - 1;
+    return ((uint64_t) ((1 << LG_SUB_BUCKETS) + (b & ((1 << LG_SUB_BUCKETS) - 1)))) << shift;
+}
+
+static inline void histogram_add(Histogram* h, uint64_t t) {
+    h->counts[histogram_bucket(t)]++;
+    h->count++;
+    h->total += t;
+    if (t > h->max)
+        h->max = t;
+}
+
+static inline void histogram_merge(Histogram* sum, const Histogram* h) {
+    for (int b = 0; b < NUM_BUCKETS; b++)
+        sum->counts[b] += h->counts[b];
+    sum->count += h->count;
+    sum->total += h->total;
+    if (h->max > sum->max)
+        sum->max = h->max;
+}
+
+// Ticks at quantile q
+static inline uint64_t histogram_quantile(const Histogram* h, double q) {
+    uint64_t rank = (uint64_t) (q * (h->count - 1));
+    uint64_t seen = 0;
+    for (int b = 0; b < NUM_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen > rank)
+            return histogram_bucket_value(b);
+    }
+    return h->max;
+}
+
+// Print the header for histogram_print, labelled with what the lines describe.
+static inline void histogram_print_header(const char* label) {
+    printf("%-20s %10s %8s %8s %8s %8s %10s  (ns)\n", label, "count", "mean", "p50", "p99", "p99.9", "max");
+}
+
+static inline void histogram_print(const char* label, const Histogram* h, double ns) {
+    if (h->count == 0)
+        return;
+    printf("%-20s %10lu %8.0f %8.0f %8.0f %8.0f %10.0f\n", label, (unsigned long) h->count,
+           (double) h->total / h->count * ns, histogram_quantile(h, 0.5) * ns, histogram_quantile(h, 0.99) * ns,
+           histogram_quantile(h, 0.999) * ns, h->max * ns);
+}
+
+#endif //BENCHMARKS_LATENCY_H
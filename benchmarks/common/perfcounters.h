@@ -0,0 +1,178 @@
+/*
+ * perfcounters.h
+ *
+ * Hardware and software event counters for the calling thread, read
+ * through perf_event_open(2), for benchmarks to wrap around their measured
+ * region. Counters the machine or perf_event_paranoid does not allow read
+ * as unavailable rather than failing. Counters are opened one by one, so
+ * the kernel may multiplex them; counts are scaled up by the time each
+ * was actually counting. Usable from C and C++.
+ *
+ *   PerfCounters counters;
+ *   perf_counters_open(&counters);
+ *   perf_counters_start(&counters);
+ *   ... measured region ...
+ *   perf_counters_stop(&counters);
+ *   perf_counters_read(&counters, &values);
+ *   perf_counters_close(&counters);
+ *
+ * Benchmarks enable them when PERF_COUNTERS is set in the environment
+ * (see perf_counters_requested()).
+ */
+
+#ifndef BENCHMARKS_PERFCOUNTERS_H
+#define BENCHMARKS_PERFCOUNTERS_H
+
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_CONTEXT_SWITCHES,
+    NUM_PERF_COUNTERS
+};
+
+static const char* const perf_counter_names[NUM_PERF_COUNTERS] = {
+    "cycles", "instructions", "L1d-misses", "LLC-misses", "dTLB-misses", "ctx-switches"
+};
+
+typedef struct perf_counters {
+    int fds[NUM_PERF_COUNTERS];  // -1 where unavailable
+} PerfCounters;
+
+typedef struct perf_values {
+    uint64_t counts[NUM_PERF_COUNTERS];
+    int available[NUM_PERF_COUNTERS];
+} PerfValues;
+
+static inline int perf_counters_requested() {
+    const char* env = getenv("PERF_COUNTERS");
+    return env != NULL && *env != '\0' && strcmp(env, "0") != 0;
+}
+
+static inline int perf_event_open_counter(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_hv = 1;
+    // Context switches are counted by the kernel; the rest only in the benchmark's own code
+    attr.exclude_kernel = type != PERF_TYPE_SOFTWARE;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+#define PERF_CACHE_READ_MISS(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+// Open the counters for the calling thread, stopped.
+static inline void perf_counters_open(PerfCounters* counters) {
+    counters->fds[PERF_CYCLES] = perf_event_open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    counters->fds[PERF_INSTRUCTIONS] = perf_event_open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    counters->fds[PERF_L1D_MISSES] =
+        perf_event_open_counter(PERF_TYPE_HW_CACHE, PERF_CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D));
+    counters->fds[PERF_LLC_MISSES] =
+        perf_event_open_counter(PERF_TYPE_HW_CACHE, PERF_CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL));
+    counters->fds[PERF_DTLB_MISSES] =
+        perf_event_open_counter(PERF_TYPE_HW_CACHE, PERF_CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB));
+    counters->fds[PERF_CONTEXT_SWITCHES] =
+        perf_event_open_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES);
+}
+
+static inline void perf_counters_start(PerfCounters* counters) {
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+        if (counters->fds[i] != -1) {
+            ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+static inline void perf_counters_stop(PerfCounters* counters) {
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+        if (counters->fds[i] != -1)
+            ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+}
+
+static inline void perf_counters_read(const PerfCounters* counters, PerfValues* values) {
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+        uint64_t data[3];  // Value, time enabled, time running
+        values->counts[i] = 0;
+        values->available[i] = counters->fds[i] != -1 && read(counters->fds[i], data, sizeof(data)) == sizeof(data);
+        if (!values->available[i])
+            continue;
+
+        values->counts[i] = data[0];
+        if (data[2] != 0 && data[2] < data[1])
+            values->counts[i] = (uint64_t) ((double) data[0] * data[1] / data[2]);
+    }
+}
+
+static inline void perf_counters_close(PerfCounters* counters) {
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+        if (counters->fds[i] != -1)
+            close(counters->fds[i]);
+        counters->fds[i] = -1;
+    }
+}
+
+// Add values into a sum, which starts zeroed
+static inline void perf_values_add(PerfValues* sum, const PerfValues* values) {
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+        sum->counts[i] += values->counts[i];
+        sum->available[i] |= values->available[i];
+    }
+}
+
+static inline void perf_values_print_header(FILE* out) {
+    fprintf(out, "%-10s", "counters");
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++)
+        fprintf(out, " %14s", perf_counter_names[i]);
+    fprintf(out, " %6s\n", "IPC");
+}
+
+static inline void perf_values_print(FILE* out, const char* label, const PerfValues* values) {
+    fprintf(out, "%-10s", label);
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+        if (values->available[i])
+            fprintf(out, " %14llu", (unsigned long long) values->counts[i]);
+        else
+            fprintf(out, " %14s", "n/a");
+    }
+
+    if (values->available[PERF_CYCLES] && values->available[PERF_INSTRUCTIONS] && values->counts[PERF_CYCLES] > 0)
+        fprintf(out, " %6.2f\n", (double) values->counts[PERF_INSTRUCTIONS] / values->counts[PERF_CYCLES]);
+    else
+        fprintf(out, " %6s\n", "n/a");
+}
+
+// Print the counters of each thread and their total.
+static inline void perf_values_report(FILE* out, const PerfValues* threads, int num_threads) {
+    PerfValues total;
+    memset(&total, 0, sizeof(total));
+    char label[32];
+
+    perf_values_print_header(out);
+    for (int t = 0; t < num_threads; t++) {
+        snprintf(label, sizeof(label), "thread %d", t);
+        perf_values_print(out, label, &threads[t]);
+        perf_values_add(&total, &threads[t]);
+    }
+    perf_values_print(out, "total", &total);
+}
+
+#endif //BENCHMARKS_PERFCOUNTERS_H
@@ -0,0 +1,190 @@
+/*
+ * latency
+ *
+ * Times individual malloc and free calls in every size class, to show the
+ * stalls that averages hide: thread cache refills and flushes, new
+ * superblocks, superblocks moving to and from the global heap. Each
+ * pattern runs for every class up to max-size:
+ *
+ *   alloc-hot    allocate a burst back to back, then free it untimed
+ *   free-hot     allocate a burst untimed, then free it back to back
+ *   remote-free  one thread allocates a burst, another frees it
+ *   transition   allocate and free a burst in each class in turn, so that
+ *                superblocks emptied in one class are reused by the next
+ *
+ * A burst is objects objects, or fewer where they would exceed 64M. Each
+ * pattern repeats rounds times. Latencies are in nanoseconds, converted
+ * from the time stamp counter.
+ *
+ * Usage: latency [ objects [ rounds [ max-size ]]]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "latency.h"
+#include "size_classes.h"
+
+#define MAX_BURST_BYTES ((size_t) 64 << 20)
+
+// mymalloc's size classes, from the generated header so that the C library build can use them too
+static const size_t class_sizes[NUM_SIZE_BINS] = SIZE_TABLE_INITIALIZER;
+
+typedef struct class_latency {
+    Histogram malloc;
+    Histogram free;
+} ClassLatency;
+
+static ClassLatency latencies[NUM_SIZE_BINS];
+static char** burst;
+static long num_objects;
+static int num_classes;
+
+static long burst_size(int idx) {
+    long n = MAX_BURST_BYTES / class_sizes[idx];
+    return n < num_objects ? n : num_objects;
+}
+
+static void alloc_burst(int idx, long n, Histogram* h) {
+    size_t size = class_sizes[idx];
+    for (long i = 0; i < n; i++) {
+        uint64_t start = ticks();
+        char* ptr = malloc(size);
+        uint64_t elapsed = ticks() - start;
+        if (ptr == NULL) {
+            fprintf(stderr, "Out of memory allocating %zu bytes\n", size);
+            exit(1);
+        }
+        *ptr = 1;
+        burst[i] = ptr;
+        if (h != NULL)
+            histogram_add(h, elapsed);
+    }
+}
+
+static void free_burst(long n, Histogram* h) {
+    for (long i = 0; i < n; i++) {
+        uint64_t start = ticks();
+        free(burst[i]);
+        uint64_t elapsed = ticks() - start;
+        if (h != NULL)
+            histogram_add(h, elapsed);
+    }
+}
+
+static void alloc_hot(int rounds) {
+    for (int idx = 0; idx < num_classes; idx++) {
+        for (int r = 0; r < rounds; r++) {
+            alloc_burst(idx, burst_size(idx), &latencies[idx].malloc);
+            free_burst(burst_size(idx), NULL);
+        }
+    }
+}
+
+static void free_hot(int rounds) {
+    for (int idx = 0; idx < num_classes; idx++) {
+        for (int r = 0; r < rounds; r++) {
+            alloc_burst(idx, burst_size(idx), NULL);
+            free_burst(burst_size(idx), &latencies[idx].free);
+        }
+    }
+}
+
+static void transition(int rounds) {
+    for (int r = 0; r < rounds; r++) {
+        for (int idx = 0; idx < num_classes; idx++) {
+            alloc_burst(idx, burst_size(idx), &latencies[idx].malloc);
+            free_burst(burst_size(idx), &latencies[idx].free);
+        }
+    }
+}
+
+// The freeing thread of remote_free, which frees each burst after the main thread has allocated it
+static pthread_barrier_t barrier;
+static int remote_rounds;
+
+static void* remote_freer(void* arg) {
+    (void) arg;
+    for (int idx = 0; idx < num_classes; idx++) {
+        for (int r = 0; r < remote_rounds; r++) {
+            pthread_barrier_wait(&barrier);
+            free_burst(burst_size(idx), &latencies[idx].free);
+            pthread_barrier_wait(&barrier);
+        }
+    }
+    return NULL;
+}
+
+static void remote_free(int rounds) {
+    remote_rounds = rounds;
+    pthread_barrier_init(&barrier, NULL, 2);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, remote_freer, NULL) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+
+    for (int idx = 0; idx < num_classes; idx++) {
+        for (int r = 0; r < rounds; r++) {
+            alloc_burst(idx, burst_size(idx), &latencies[idx].malloc);
+            pthread_barrier_wait(&barrier);
+            pthread_barrier_wait(&barrier);
+        }
+    }
+
+    pthread_join(thread, NULL);
+    pthread_barrier_destroy(&barrier);
+}
+
+static void report(const char* pattern, double ns) {
+    printf("\n");
+    histogram_print_header(pattern);
+
+    char label[32];
+    for (int idx = 0; idx < num_classes; idx++) {
+        snprintf(label, sizeof(label), "  malloc %zu", class_sizes[idx]);
+        histogram_print(label, &latencies[idx].malloc, ns);
+        snprintf(label, sizeof(label), "  free %zu", class_sizes[idx]);
+        histogram_print(label, &latencies[idx].free, ns);
+    }
+
+    Histogram all_malloc = { 0 }, all_free = { 0 };
+    for (int idx = 0; idx < num_classes; idx++) {
+        histogram_merge(&all_malloc, &latencies[idx].malloc);
+        histogram_merge(&all_free, &latencies[idx].free);
+    }
+    histogram_print("  malloc (all)", &all_malloc, ns);
+    histogram_print("  free (all)", &all_free, ns);
+
+    memset(latencies, 0, sizeof(latencies));
+}
+
+int main(int argc, char* argv[]) {
+    num_objects = argc > 1 ? atol(argv[1]) : 10000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 20;
+    size_t max_size = argc > 3 ? (size_t) atol(argv[3]) : MAX_BLOCK_SIZE;
+
+    for (num_classes = 0; num_classes < NUM_SIZE_BINS && class_sizes[num_classes] <= max_size; num_classes++);
+
+    burst = malloc(num_objects * sizeof(char*));
+    if (burst == NULL)
+        return 1;
+
+    double ns = tick_ns();
+    printf("%d size classes up to %zu bytes, bursts of up to %ld objects, %d rounds\n",
+           num_classes, class_sizes[num_classes - 1], num_objects, rounds);
+
+    alloc_hot(rounds);
+    report("alloc-hot", ns);
+    free_hot(rounds);
+    report("free-hot", ns);
+    remote_free(rounds);
+    report("remote-free", ns);
+    transition(rounds);
+    report("transition", ns);
+
+    free(burst);
+    return 0;
+}
@@ -0,0 +1,415 @@
+/*
+ * replay
+ *
+ * Re-executes an allocation trace recorded with MYMALLOC_TRACE (see
+ * include/trace.h) against whichever malloc the binary runs with:
+ * trace_replay uses the C library's, trace_replay_mymalloc is linked
+ * against mymalloc. Each thread of the trace gets a thread of its own that
+ * performs that thread's operations in order, as fast as it can; an
+ * operation on an object allocated by another thread waits until that
+ * thread has allocated it. Reports throughput, the latency of each kind of
+ * operation and the peak footprint, next to the peak of live bytes in the
+ * trace itself.
+ *
+ * Frees of objects allocated before tracing started are skipped. Unless
+ * touch is 0, one byte of every page of each allocation is written after
+ * it returns, outside the timed region, so that the footprint is resident.
+ *
+ * Usage: replay trace-file [ touch ]
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "latency.h"
+#include "trace.h"
+
+#define NO_OBJECT UINT32_MAX
+#define PAGE 4096
+
+#define NUM_OPS (TRACE_FREE + 1)
+
+static const char* op_names[NUM_OPS] = { "malloc", "calloc", "realloc", "memalign", "free" };
+
+// An operation of one thread, on objects numbered in the order they were allocated
+typedef struct op {
+    uint32_t type;
+    uint32_t object;  // Allocated or freed
+    uint32_t old_object;  // Reallocated, or NO_OBJECT
+    uint32_t wait;  // Whether object or old_object may be allocated by another thread
+    uint64_t size;
+    uint64_t alignment;
+} Op;
+
+typedef struct thread_ops {
+    Op* ops;
+    size_t count;
+    Histogram latencies[NUM_OPS];
+} ThreadOps;
+
+static ThreadOps* threads;
+static void* _Atomic* objects;
+static int touch = 1;
+static pthread_barrier_t barrier;
+
+// The replay's own data is mapped directly, so that it stays out of the allocator being measured.
+static void* map(size_t size) {
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return ptr;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Address -> object map for reading the trace, open addressing with tombstones
+typedef struct address_map {
+    uint64_t* keys;  // 0 for empty, 1 for deleted
+    uint32_t* values;
+    size_t mask;
+} AddressMap;
+
+static size_t map_slot(const AddressMap* m, uint64_t key) {
+    size_t i = (key * 0x9E3779B97F4A7C15ULL) >> 20 & m->mask;
+    while (m->keys[i] != 0 && m->keys[i] != key)
+        i = (i + 1) & m->mask;
+    return i;
+}
+
+static uint32_t map_take(AddressMap* m, uint64_t key) {
+    size_t i = map_slot(m, key);
+    if (m->keys[i] == 0)
+        return NO_OBJECT;
+    m->keys[i] = 1;
+    return m->values[i];
+}
+
+static void map_put(AddressMap* m, uint64_t key, uint32_t value) {
+    size_t i = map_slot(m, key);
+    if (m->keys[i] == 0) {
+        // Reuse the first tombstone on the way, so that they do not pile up
+        size_t j = (key * 0x9E3779B97F4A7C15ULL) >> 20 & m->mask;
+        while (m->keys[j] != 1 && j != i)
+            j = (j + 1) & m->mask;
+        i = j;
+    }
+    m->keys[i] = key;
+    m->values[i] = value;
+}
+
+static const TraceEvent* events;
+
+static int compare_events(const void* a, const void* b) {
+    const TraceEvent* x = &events[*(const uint32_t*) a];
+    const TraceEvent* y = &events[*(const uint32_t*) b];
+    if (x->time != y->time)
+        return x->time < y->time ? -1 : 1;
+    return *(const uint32_t*) a < *(const uint32_t*) b ? -1 : 1;
+}
+
+// Turn the events into per-thread operations on numbered objects. Returns the number of threads.
+static int read_trace(const char* path, size_t* num_objects, size_t* peak_live_bytes) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        exit(1);
+    }
+
+    const TraceHeader* header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (header == MAP_FAILED || (size_t) st.st_size < sizeof(TraceHeader) || header->magic != TRACE_MAGIC ||
+        header->version != TRACE_VERSION || header->event_size != sizeof(TraceEvent)) {
+        fprintf(stderr, "%s: not a trace of this version\n", path);
+        exit(1);
+    }
+    close(fd);
+
+    events = (const TraceEvent*) (header + 1);
+    size_t num_events = (st.st_size - sizeof(TraceHeader)) / sizeof(TraceEvent);
+
+    // Threads flush their buffers at different times, so the events of different threads are merged by time
+    uint32_t* order = map(num_events * sizeof(uint32_t));
+    for (size_t i = 0; i < num_events; i++)
+        order[i] = i;
+    qsort(order, num_events, sizeof(uint32_t), compare_events);
+
+    int num_threads = 0;
+    for (size_t i = 0; i < num_events; i++) {
+        if ((int) events[i].thread >= num_threads)
+            num_threads = events[i].thread + 1;
+    }
+
+    // Size each thread's operations by its events, counted in the count fields for now
+    threads = map(num_threads * sizeof(ThreadOps));
+    for (size_t i = 0; i < num_events; i++)
+        threads[events[i].thread].count++;
+    for (int t = 0; t < num_threads; t++) {
+        threads[t].ops = map((threads[t].count + 1) * sizeof(Op));
+        threads[t].count = 0;
+    }
+
+    AddressMap addresses;
+    size_t capacity = 16;
+    while (capacity < 2 * num_events)
+        capacity *= 2;
+    addresses.keys = map(capacity * sizeof(uint64_t));
+    addresses.values = map(capacity * sizeof(uint32_t));
+    addresses.mask = capacity - 1;
+
+    // The object each thread's pending realloc releases, taken by its TRACE_REALLOC_FREE event
+    uint32_t* releasing = map(num_threads * sizeof(uint32_t));
+    for (int t = 0; t < num_threads; t++)
+        releasing[t] = NO_OBJECT;
+
+    uint32_t* creators = map(num_events * sizeof(uint32_t));
+    uint64_t* sizes = map(num_events * sizeof(uint64_t));
+    size_t objects_allocated = 0, live_bytes = 0;
+    *peak_live_bytes = 0;
+
+    for (size_t i = 0; i < num_events; i++) {
+        const TraceEvent* event = &events[order[i]];
+        ThreadOps* thread = &threads[event->thread];
+        Op op = { .type = event->op, .object = NO_OBJECT, .old_object = NO_OBJECT, .size = event->size };
+
+        if (event->op == TRACE_REALLOC_FREE) {
+            // Stamped before the realloc, so before another thread can reuse the address
+            uint32_t freed = map_take(&addresses, event->ptr);
+            if (freed != NO_OBJECT)
+                live_bytes -= sizes[freed];
+            releasing[event->thread] = freed;
+            continue;
+        }
+
+        if (event->op == TRACE_FREE || event->op == TRACE_REALLOC) {
+            uint32_t freed;
+            if (event->op == TRACE_FREE) {
+                freed = map_take(&addresses, event->ptr);
+                if (freed != NO_OBJECT)
+                    live_bytes -= sizes[freed];
+            } else {
+                freed = releasing[event->thread];
+                releasing[event->thread] = NO_OBJECT;
+            }
+            if (freed != NO_OBJECT)
+                op.wait = creators[freed] != event->thread;
+
+            if (event->op == TRACE_FREE) {
+                if (freed == NO_OBJECT)
+                    continue;  // Allocated before the trace started
+                op.object = freed;
+            } else {
+                op.old_object = freed;
+                if (event->ptr == 0) {
+                    // Reallocated to size 0, which frees
+                    if (freed == NO_OBJECT)
+                        continue;
+                    op.type = TRACE_FREE;
+                    op.object = freed;
+                    op.old_object = NO_OBJECT;
+                }
+            }
+        } else if (event->op == TRACE_MEMALIGN) {
+            op.alignment = event->arg < sizeof(void*) ? sizeof(void*) : event->arg;
+        } else if (event->op != TRACE_MALLOC && event->op != TRACE_CALLOC) {
+            fprintf(stderr, "Unknown operation %u in event %zu\n", event->op, (size_t) order[i]);
+            exit(1);
+        }
+
+        if (op.type != TRACE_FREE) {
+            op.object = objects_allocated++;
+            creators[op.object] = event->thread;
+            sizes[op.object] = event->size;
+            live_bytes += event->size;
+            if (live_bytes > *peak_live_bytes)
+                *peak_live_bytes = live_bytes;
+
+            // A new object at a live address means the old one's free was lost; forget it
+            map_put(&addresses, event->ptr, op.object);
+        }
+
+        thread->ops[thread->count++] = op;
+    }
+
+    munmap(order, num_events * sizeof(uint32_t));
+    munmap(addresses.keys, capacity * sizeof(uint64_t));
+    munmap(addresses.values, capacity * sizeof(uint32_t));
+    munmap(releasing, num_threads * sizeof(uint32_t));
+    munmap(creators, num_events * sizeof(uint32_t));
+    munmap(sizes, num_events * sizeof(uint64_t));
+    munmap((void*) header, st.st_size);
+
+    *num_objects = objects_allocated;
+    return num_threads;
+}
+
+static void* wait_for(uint32_t object) {
+    void* ptr;
+    while ((ptr = atomic_load_explicit(&objects[object], memory_order_acquire)) == NULL)
+        sched_yield();
+    return ptr;
+}
+
+static void* replay_thread(void* arg) {
+    ThreadOps* thread = arg;
+    pthread_barrier_wait(&barrier);
+
+    for (size_t i = 0; i < thread->count; i++) {
+        const Op* op = &thread->ops[i];
+        void* old = NULL;
+        if (op->type == TRACE_FREE)
+            old = op->wait ? wait_for(op->object) : atomic_load_explicit(&objects[op->object], memory_order_relaxed);
+        else if (op->old_object != NO_OBJECT)
+            old = op->wait ? wait_for(op->old_object) :
+                  atomic_load_explicit(&objects[op->old_object], memory_order_relaxed);
+
+        void* ptr = NULL;
+        uint64_t start = ticks();
+        switch (op->type) {
+            case TRACE_MALLOC:
+                ptr = malloc(op->size);
+                break;
+            case TRACE_CALLOC:
+                ptr = calloc(1, op->size);
+                break;
+            case TRACE_REALLOC:
+                ptr = realloc(old, op->size);
+                break;
+            case TRACE_MEMALIGN:
+                if (posix_memalign(&ptr, op->alignment, op->size) != 0)
+                    ptr = NULL;
+                break;
+            case TRACE_FREE:
+                free(old);
+                break;
+        }
+        histogram_add(&thread->latencies[op->type], ticks() - start);
+
+        if (op->type != TRACE_FREE) {
+            if (ptr == NULL) {
+                fprintf(stderr, "Out of memory allocating %lu bytes\n", (unsigned long) op->size);
+                exit(1);
+            }
+            if (touch) {
+                for (size_t offset = 0; offset < op->size; offset += PAGE)
+                    ((volatile char*) ptr)[offset] = 1;
+            }
+            atomic_store_explicit(&objects[op->object], ptr, memory_order_release);
+        }
+    }
+    return NULL;
+}
+
+// Resident or peak resident kilobytes, from /proc/self/status
+static long status_kb(const char* field) {
+    FILE* f = fopen("/proc/self/status", "r");
+    if (f == NULL)
+        return -1;
+
+    char line[256];
+    long kb = -1;
+    size_t len = strlen(field);
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, field, len) == 0 && line[len] == ':') {
+            kb = atol(line + len + 1);
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+// Reset VmHWM to the current RSS, so that it only covers the replay
+static int reset_peak_rss() {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd < 0)
+        return -1;
+    int ok = write(fd, "5", 1) == 1;
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s trace-file [ touch ]\n", argv[0]);
+        return 1;
+    }
+    touch = argc > 2 ? atoi(argv[2]) : 1;
+
+    size_t num_objects, peak_live_bytes;
+    int num_threads = read_trace(argv[1], &num_objects, &peak_live_bytes);
+    objects = map((num_objects + 1) * sizeof(void*));
+
+    size_t num_ops = 0;
+    int active = 0;
+    for (int t = 0; t < num_threads; t++) {
+        num_ops += threads[t].count;
+        active += threads[t].count > 0;
+    }
+
+    double ns = tick_ns();
+    const char* allocator = dlsym(RTLD_DEFAULT, "mymalloc_stat") != NULL ? "mymalloc" : "libc";
+
+    pthread_t* ids = map(num_threads * sizeof(pthread_t));
+    pthread_barrier_init(&barrier, NULL, active + 1);
+
+    // Thread stacks and the like are mapped before the peak is reset
+    for (int t = 0; t < num_threads; t++) {
+        if (threads[t].count > 0 && pthread_create(&ids[t], NULL, replay_thread, &threads[t]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    long base_kb = status_kb("VmRSS");
+    int have_peak = reset_peak_rss() == 0;
+
+    pthread_barrier_wait(&barrier);
+    double start = now();
+    for (int t = 0; t < num_threads; t++) {
+        if (threads[t].count > 0)
+            pthread_join(ids[t], NULL);
+    }
+    double elapsed = now() - start;
+
+    long peak_kb = status_kb("VmHWM");
+    long end_kb = status_kb("VmRSS");
+
+    printf("%s: %zu operations on %zu objects in %d threads\n", allocator, num_ops, num_objects, active);
+    printf("time:       %.2f ms\n", elapsed * 1e3);
+    printf("throughput: %.2f M ops/s\n", num_ops / elapsed / 1e6);
+    printf("live bytes: %.2f MB at peak in the trace\n", peak_live_bytes / 1048576.0);
+    if (have_peak && peak_kb >= 0 && base_kb >= 0)
+        printf("footprint:  %.2f MB at peak, %.2f MB at end\n", (peak_kb - base_kb) / 1024.0,
+               (end_kb - base_kb) / 1024.0);
+    else
+        printf("footprint:  n/a\n");
+
+    printf("\n");
+    histogram_print_header("latency");
+    for (int type = 0; type < NUM_OPS; type++) {
+        Histogram sum = { 0 };
+        for (int t = 0; t < num_threads; t++)
+            histogram_merge(&sum, &threads[t].latencies[type]);
+        histogram_print(op_names[type], &sum, ns);
+    }
+
+    return 0;
+}
@@ -0,0 +1,321 @@
+#!/usr/bin/env python3
+"""
+Runs the allocator benchmarks against mymalloc and the system allocator over
+a sweep of thread counts, and writes the results as CSV and JSON.
+
+Each benchmark is built twice by CMake (see add_allocator_benchmark): <name>
+uses the C library's malloc and <name>_mymalloc is linked against mymalloc.
+With --preload, mymalloc is instead preloaded into <name>, and --allocator
+NAME=LIB adds other preloaded allocators to compare with.
+
+Every result has a throughput: the benchmark's work divided by its time, or
+the rate larson reports itself. Speedup is relative to the same allocator at
+the fewest threads, vs_system to the system allocator at the same threads.
+Given --baseline, a previous JSON report, throughputs that dropped by more
+than --tolerance are reported and make the exit status 1. The system
+allocator is not checked: its changes show how noisy the machine is.
+
+Footprint counts as much as throughput. Every run's resident set size is
+polled from /proc every --interval ms for its peak and average. Peak
+resident sizes that grew by more than --tolerance are regressions as well.
+
+With --footprint, each mymalloc point is also run --repeat more times with
+MYMALLOC_FOOTPRINT set (see src/footprint.c), sampling the allocator every
+--footprint-interval ms. The sampler locks every heap, so these runs are kept
+apart from the ones whose throughput and resident size are reported. They
+give the peak of the bytes live in the program, and its fragmentation: the
+bytes the heaps hold over the bytes live, on average. Blowup is the peak
+resident size over that peak live size, taken from mymalloc at the same
+point for every allocator, since the program asks for the same memory
+whichever allocator serves it.
+
+Usage: run.py [ --build ] [ --threads 1,2,4 ] [ --benchmarks larson,... ]
+              [ --output results ] [ --baseline old.json ] [ --footprint ]
+"""
+
+import argparse
+import csv
+import json
+import os
+import platform
+import re
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+
+class Benchmark:
+    def __init__(self, target, args, work, unit, pattern=None, rate=False):
+        self.target = target  # CMake target of the system allocator build
+        self.args = args  # Thread count -> command line arguments
+        self.work = work  # Thread count -> units of work per run
+        self.unit = unit
+        self.pattern = pattern  # Regex for the time (or the rate) the benchmark prints, else wall time
+        self.rate = rate  # The pattern matches a rate rather than a time
+
+
+ELAPSED = r"Time elapsed = ([0-9.]+)"
+
+# Parameters are sized for a few seconds per run at most
+BENCHMARKS = {
+    "cache-scratch": Benchmark(
+        "cache_scratch", lambda t: [t, 100, 8, 100000], lambda t: 100 * 100000 * 8, "writes/s", ELAPSED),
+    "cache-thrash": Benchmark(
+        "cache_thrash", lambda t: [t, 100, 8, 100000], lambda t: 100 * 100000 * 8, "writes/s", ELAPSED),
+    "larson": Benchmark(
+        "larson", lambda t: [2, 8, 1000, 5000, 1000, 1, t], None, "ops/s",
+        r"Throughput =\s*([0-9.]+) operations per second", rate=True),
+    "linux-scalability": Benchmark(
+        "linux_scalability", lambda t: [8, 1000000, t], lambda t: 1000000 * t, "allocs/s",
+        r"Average execution time = ([0-9.]+)"),
+    "phong": Benchmark(
+        "phong", lambda t: ["-t%d" % t, "-a5000"], lambda t: 5000, "allocs/s"),
+    "threadtest": Benchmark(
+        "threadtest", lambda t: [t, 50, 30000, 0, 8], lambda t: 50 * 30000, "allocs/s", ELAPSED),
+}
+
+
+def default_threads():
+    cpus = os.cpu_count() or 1
+    threads = [1]
+    while threads[-1] * 2 <= cpus:
+        threads.append(threads[-1] * 2)
+    if threads[-1] != cpus:
+        threads.append(cpus)
+    return threads
+
+
+def build(build_dir):
+    subprocess.run(["cmake", "-S", ROOT, "-B", build_dir, "-DCMAKE_BUILD_TYPE=Release"], check=True)
+    subprocess.run(["cmake", "--build", build_dir, "-j%d" % (os.cpu_count() or 1)], check=True)
+
+
+def allocators(args):
+    """Allocator name -> (binary suffix, library to preload or None)"""
+    library = os.path.join(args.build_dir, "libmymalloc.so")
+    result = {"system": ("", None)}
+    result["mymalloc"] = ("", library) if args.preload else ("_mymalloc", None)
+    for spec in args.allocator:
+        name, _, path = spec.partition("=")
+        result[name] = ("", os.path.abspath(path))
+    return result
+
+
+def resident_bytes(pid):
+    try:
+        with open("/proc/%d/status" % pid) as f:
+            for line in f:
+                if line.startswith("VmRSS:"):
+                    return int(line.split()[1]) * 1024
+    except OSError:
+        pass
+    return None
+
+
+def read_footprint(path):
+    """The "# name value" summary that mymalloc appends to its footprint samples"""
+    summary = {}
+    try:
+        with open(path) as f:
+            for line in f:
+                if line.startswith("# "):
+                    name, value = line[2:].split()
+                    summary[name] = float(value)
+    except (OSError, ValueError):
+        pass
+    return summary
+
+
+class Run:
+    def __init__(self, seconds, throughput, peak_rss, avg_rss, footprint):
+        self.seconds = seconds
+        self.throughput = throughput
+        self.peak_rss = peak_rss
+        self.avg_rss = avg_rss
+        self.footprint = footprint  # mymalloc's summary, empty for other allocators
+
+
+def run_once(command, env, bench, threads, interval, footprint_path=None, footprint_interval=None):
+    env = dict(env)
+    if footprint_path is not None:
+        env["MYMALLOC_FOOTPRINT"] = footprint_path
+        env["MYMALLOC_FOOTPRINT_MS"] = str(footprint_interval)
+
+    samples = []
+    with tempfile.TemporaryFile(mode="w+") as out:
+        start = time.monotonic()
+        proc = subprocess.Popen(command, env=env, stdout=out, stderr=subprocess.STDOUT, text=True)
+        while proc.poll() is None:
+            rss = resident_bytes(proc.pid)
+            if rss is not None:
+                samples.append(rss)
+            if time.monotonic() - start > 600:
+                proc.kill()
+                proc.wait()
+                raise RuntimeError("%s timed out" % " ".join(command))
+            time.sleep(interval / 1000)
+        wall = time.monotonic() - start
+        out.seek(0)
+        stdout = out.read()
+
+    if proc.returncode != 0:
+        raise RuntimeError("%s exited with %d:\n%s" % (" ".join(command), proc.returncode, stdout))
+
+    footprint = read_footprint(footprint_path) if footprint_path is not None else {}
+    # Runs shorter than the interval have no samples of their own; mymalloc's sampler still has one
+    peak_rss = max(samples, default=footprint.get("peak_rss", 0))
+    avg_rss = statistics.mean(samples) if samples else footprint.get("avg_rss", 0)
+
+    if bench.pattern is None:
+        return Run(wall, bench.work(threads) / wall, peak_rss, avg_rss, footprint)
+
+    match = re.search(bench.pattern, stdout)
+    if match is None:
+        raise RuntimeError("no result in the output of %s:\n%s" % (" ".join(command), stdout))
+    value = float(match.group(1))
+    if bench.rate:
+        return Run(wall, value, peak_rss, avg_rss, footprint)
+    return Run(value, bench.work(threads) / value, peak_rss, avg_rss, footprint)
+
+
+def median_of(runs, key):
+    values = [r.footprint[key] for r in runs if key in r.footprint]
+    return statistics.median(values) if values else None
+
+
+def run(args):
+    results = []
+    if args.footprint:
+        footprint_file = tempfile.NamedTemporaryFile(prefix="footprint-", suffix=".csv", delete=False)
+        footprint_file.close()
+    for name in args.benchmarks:
+        bench = BENCHMARKS[name]
+        for allocator, (suffix, preload) in allocators(args).items():
+            binary = os.path.join(args.build_dir, bench.target + suffix)
+            if not os.path.exists(binary):
+                sys.exit("%s not found; build first, or pass --build" % binary)
+
+            env = dict(os.environ)
+            if preload is not None:
+                env["LD_PRELOAD"] = preload
+
+            for threads in args.threads:
+                command = [binary] + [str(a) for a in bench.args(threads)]
+                runs = [run_once(command, env, bench, threads, args.interval) for _ in range(args.repeat)]
+                sampled = []
+                if args.footprint and allocator == "mymalloc":
+                    sampled = [run_once(command, env, bench, threads, args.interval, footprint_file.name,
+                                        args.footprint_interval) for _ in range(args.repeat)]
+                seconds = statistics.median(r.seconds for r in runs)
+                throughput = statistics.median(r.throughput for r in runs)
+                peak_rss = statistics.median(r.peak_rss for r in runs)
+                print("%-18s %-10s %3d threads  %12.4g %-9s %8.3f s  %8.1f MB peak" %
+                      (name, allocator, threads, throughput, bench.unit, seconds, peak_rss / 2**20), flush=True)
+                results.append({"benchmark": name, "allocator": allocator, "threads": threads,
+                                "seconds": seconds, "throughput": throughput, "unit": bench.unit,
+                                "peak_rss": peak_rss, "avg_rss": statistics.median(r.avg_rss for r in runs),
+                                "peak_live": median_of(sampled, "peak_allocated"),
+                                "fragmentation": median_of(sampled, "fragmentation"),
+                                "sb_blowup": median_of(sampled, "sb_blowup")})
+    if args.footprint:
+        os.unlink(footprint_file.name)
+
+    # Speedup curves, and each allocator against the system one
+    for row in results:
+        same = [r for r in results if r["benchmark"] == row["benchmark"] and r["allocator"] == row["allocator"]]
+        first = min(same, key=lambda r: r["threads"])
+        row["speedup"] = row["throughput"] / first["throughput"]
+        system = [r for r in results if r["benchmark"] == row["benchmark"] and r["allocator"] == "system"
+                  and r["threads"] == row["threads"]]
+        row["vs_system"] = row["throughput"] / system[0]["throughput"] if system else None
+
+    # Blowup against the bytes the program keeps live, which only mymalloc's counters tell
+    for row in results:
+        live = [r["peak_live"] for r in results if r["benchmark"] == row["benchmark"]
+                and r["threads"] == row["threads"] and r["peak_live"]]
+        row["blowup"] = row["peak_rss"] / live[0] if live else None
+    return results
+
+
+def write_reports(results, output):
+    fields = ["benchmark", "allocator", "threads", "seconds", "throughput", "unit", "speedup", "vs_system",
+              "peak_rss", "avg_rss", "peak_live", "blowup", "fragmentation", "sb_blowup"]
+    with open(output + ".csv", "w", newline="") as f:
+        writer = csv.DictWriter(f, fieldnames=fields)
+        writer.writeheader()
+        writer.writerows(results)
+
+    report = {
+        "host": platform.node(),
+        "machine": platform.machine(),
+        "cpus": os.cpu_count(),
+        "date": time.strftime("%Y-%m-%dT%H:%M:%S"),
+        "results": results,
+    }
+    with open(output + ".json", "w") as f:
+        json.dump(report, f, indent=2)
+    print("Wrote %s.csv and %s.json" % (output, output))
+
+
+def compare(results, baseline_path, tolerance):
+    """Print throughput and peak footprint changes against the baseline. Returns the number of regressions."""
+    with open(baseline_path) as f:
+        baseline = {(r["benchmark"], r["allocator"], r["threads"]): r for r in json.load(f)["results"]}
+
+    regressions = 0
+    print("\nAgainst %s:" % baseline_path)
+    for row in results:
+        old = baseline.get((row["benchmark"], row["allocator"], row["threads"]))
+        if old is None:
+            continue
+        change = row["throughput"] / old["throughput"] - 1
+        growth = row["peak_rss"] / old["peak_rss"] - 1 if old.get("peak_rss") else 0
+        flag = ""
+        if row["allocator"] != "system" and (change < -tolerance or growth > tolerance):
+            flag = "  REGRESSION"
+            regressions += 1
+        print("%-18s %-10s %3d threads  %+7.1f%%  footprint %+7.1f%%%s" %
+              (row["benchmark"], row["allocator"], row["threads"], change * 100, growth * 100, flag))
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().split("\n\n")[0])
+    parser.add_argument("--build-dir", default=os.path.join(ROOT, "build"))
+    parser.add_argument("--build", action="store_true", help="configure and build a release build first")
+    parser.add_argument("--threads", type=lambda s: [int(t) for t in s.split(",")], default=default_threads())
+    parser.add_argument("--benchmarks", type=lambda s: s.split(","), default=list(BENCHMARKS))
+    parser.add_argument("--repeat", type=int, default=3, help="runs per point, of which the median is kept")
+    parser.add_argument("--preload", action="store_true", help="preload mymalloc instead of linking it")
+    parser.add_argument("--allocator", action="append", default=[], metavar="NAME=LIB",
+                        help="also run with LIB preloaded")
+    parser.add_argument("--output", default="results", help="write OUTPUT.csv and OUTPUT.json")
+    parser.add_argument("--baseline", help="JSON report to compare throughputs with")
+    parser.add_argument("--tolerance", type=float, default=0.05,
+                        help="throughput drop or footprint growth flagged as a regression")
+    parser.add_argument("--interval", type=int, default=10, help="resident size polling period in ms")
+    parser.add_argument("--footprint", action="store_true",
+                        help="also sample mymalloc's counters, in runs of their own")
+    parser.add_argument("--footprint-interval", type=int, default=100,
+                        help="allocator footprint sampling period in ms")
+    args = parser.parse_args()
+
+    for name in args.benchmarks:
+        if name not in BENCHMARKS:
+            parser.error("unknown benchmark %s (have %s)" % (name, ", ".join(BENCHMARKS)))
+    args.build_dir = os.path.abspath(args.build_dir)
+    if args.build:
+        build(args.build_dir)
+
+    results = run(args)
+    write_reports(results, args.output)
+    if args.baseline is not None and compare(results, args.baseline, args.tolerance) > 0:
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
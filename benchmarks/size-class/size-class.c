@@ -0,0 +1,86 @@
+/*
+ * size-class
+ *
+ * Measures the cost of mapping a request size to its size class, comparing
+ * the binary search over size_table that malloc used to do with the
+ * generated lookup tables behind size2idx().
+ *
+ * Usage: size-class [ iterations [ max-size ]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "binmanager.h"
+
+#define NUM_SIZES 4096  // Power of two, so the size array is indexed with a mask
+
+static size_t sizes[NUM_SIZES];
+
+// The lookup malloc used before the size classes were generated at build time.
+static int size2idx_bsearch(size_t size) {
+    int i = 0, j = NUM_SIZE_BINS;
+
+    while (i < j) {
+        int s = i + (j - i) / 2;
+        if (size > size_table[s]) {
+            i = s + 1;
+        } else {
+            j = s;
+        }
+    }
+
+    return j;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double time_lookup(int (*lookup)(size_t), long iterations, long* checksum) {
+    long sum = 0;
+    double start = now();
+
+    for (long i = 0; i < iterations; i++)
+        sum += lookup(sizes[i & (NUM_SIZES - 1)]);
+
+    double elapsed = now() - start;
+    *checksum = sum;
+    return elapsed * 1e9 / iterations;
+}
+
+static int size2idx_table(size_t size) {
+    return size2idx(size);
+}
+
+int main(int argc, char* argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : 100000000;
+    size_t max_size = argc > 2 ? (size_t) atol(argv[2]) : MAX_BLOCK_SIZE;
+    if (max_size == 0 || max_size > MAX_BLOCK_SIZE)
+        max_size = MAX_BLOCK_SIZE;
+
+    // Favor small sizes, like real programs do.
+    srand(1);
+    for (int i = 0; i < NUM_SIZES; i++) {
+        size_t limit = (rand() % 4 == 0) ? max_size : (max_size < 512 ? max_size : 512);
+        sizes[i] = 1 + (size_t) rand() % limit;
+    }
+
+    for (int i = 0; i < NUM_SIZES; i++) {
+        if (size2idx(sizes[i]) != size2idx_bsearch(sizes[i])) {
+            fprintf(stderr, "Mismatch for size %zu\n", sizes[i]);
+            return 1;
+        }
+    }
+
+    long checksum_bsearch, checksum_table;
+    double ns_bsearch = time_lookup(size2idx_bsearch, iterations, &checksum_bsearch);
+    double ns_table = time_lookup(size2idx_table, iterations, &checksum_table);
+
+    printf("%d size classes, max block size %d, %ld lookups\n", NUM_SIZE_BINS, MAX_BLOCK_SIZE, iterations);
+    printf("binary search: %.2f ns/lookup\n", ns_bsearch);
+    printf("lookup table:  %.2f ns/lookup\n", ns_table);
+    return checksum_bsearch != checksum_table;
+}
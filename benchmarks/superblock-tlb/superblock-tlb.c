@@ -0,0 +1,90 @@
+/*
+ * superblock-tlb
+ *
+ * Spreads live objects over many superblocks and then touches them in a
+ * random order, so that nearly every access lands on a different page.
+ * Reports the access rate and, where perf events are available, the dTLB
+ * load misses (and with PERF_COUNTERS set, the other counters of
+ * perfcounters.h). Build mymalloc with and without MYMALLOC_HUGEPAGE_SEGMENTS
+ * to compare.
+ *
+ * Usage: superblock-tlb [ objects [ object-size [ accesses ]]]
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "perfcounters.h"
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+int main(int argc, char* argv[]) {
+    long num_objects = argc > 1 ? atol(argv[1]) : 200000;
+    size_t object_size = argc > 2 ? (size_t) atol(argv[2]) : 4096;
+    long accesses = argc > 3 ? atol(argv[3]) : 20000000;
+
+    char** objects = malloc(num_objects * sizeof(char*));
+    if (objects == NULL)
+        return 1;
+
+    double start = now();
+    for (long i = 0; i < num_objects; i++) {
+        objects[i] = malloc(object_size);
+        if (objects[i] == NULL) {
+            fprintf(stderr, "Out of memory after %ld objects\n", i);
+            return 1;
+        }
+        memset(objects[i], (int) i, object_size);
+    }
+    double alloc_time = now() - start;
+
+    PerfCounters counters;
+    perf_counters_open(&counters);
+    perf_counters_start(&counters);
+
+    uint64_t state = 88172645463325252ULL;
+    unsigned long sum = 0;
+    start = now();
+    for (long i = 0; i < accesses; i++) {
+        uint64_t r = next_random(&state);
+        char* object = objects[r % num_objects];
+        sum += object[(r >> 32) % object_size];
+    }
+    double access_time = now() - start;
+
+    PerfValues values;
+    perf_counters_stop(&counters);
+    perf_counters_read(&counters, &values);
+    perf_counters_close(&counters);
+
+    for (long i = 0; i < num_objects; i++)
+        free(objects[i]);
+    free(objects);
+
+    printf("%ld objects of %zu bytes, %ld random accesses (checksum %lu)\n", num_objects, object_size,
+           accesses, sum);
+    printf("allocation: %.2f ms\n", alloc_time * 1e3);
+    printf("access:     %.2f M accesses/s\n", accesses / access_time / 1e6);
+    if (values.available[PERF_DTLB_MISSES])
+        printf("dTLB misses: %.4f per access\n", (double) values.counts[PERF_DTLB_MISSES] / accesses);
+    else
+        printf("dTLB misses: n/a\n");
+    if (perf_counters_requested())
+        perf_values_report(stdout, &values, 1);
+
+    return 0;
+}
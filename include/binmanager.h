@@ -2,24 +2,47 @@
 #define MYMALLOC_BINMANAGER_H
 
 #include "superblock.h"
+#include "size_classes.h"
 
 typedef struct bin_manager {
     // Linked lists sorted by emptiness class (fullest to emptiest)
     Superblock* emptiness_bins[NUM_EMPTINESS_CLASSES];
     unsigned int num_nonfull_superblocks;  // Number of superblocks in this bin that are not full
+    unsigned int nonempty_classes;  // Bit eidx is set when emptiness_bins[eidx] is not empty
 } BinManager;
 
-extern bool size_table_initialized;
-extern int num_size_bins;
+_Static_assert(NUM_EMPTINESS_CLASSES <= 32, "emptiness classes must fit an unsigned int bitmap");
 
-// Initialize the size table. Called when the heap is initialized.
-void init_size_table();
+// Size class tables, generated at build time (see tools/gen_size_classes.c)
+extern const size_t size_table[NUM_SIZE_BINS];
+extern const unsigned char small_size_lookup[SMALL_LOOKUP_SIZE];
+extern const unsigned char large_size_lookup[LARGE_LOOKUP_SIZE];
 
-size_t idx2class(int idx);
+static inline size_t idx2class(int idx) {
+    return size_table[idx];
+}
 
-int size2idx(size_t size);
+// Index of the smallest size class that fits size. Assumes 0 < size <= MAX_BLOCK_SIZE.
+static inline int size2idx(size_t size) {
+    if (size <= SMALL_LOOKUP_MAX)
+        return small_size_lookup[(size + MIN_BLOCK_SIZE - 1) >> LG_MIN_BLOCK_SIZE];
 
-extern size_t max_block_size;
+    // At most one class boundary falls within a granule of the large table.
+    int idx = large_size_lookup[(size - 1) >> LARGE_LOOKUP_SHIFT];
+    return idx + (size > size_table[idx]);
+}
+
+// Index of the smallest size class that fits size and whose blocks are aligned to alignment,
+// a power of two up to PAGE_SIZE, or -1 if there is none.
+static inline int size2idx_aligned(size_t size, size_t alignment) {
+    if (size > MAX_BLOCK_SIZE)
+        return -1;
+
+    int idx = size2idx(size > alignment ? size : alignment);
+    while (idx < NUM_SIZE_BINS && (size_table[idx] & (alignment - 1)) != 0)
+        idx++;
+    return idx < NUM_SIZE_BINS ? idx : -1;
+}
 
 // Add to the head of the linked list (superblock becomes new head)
 void push_into_bin(BinManager* bin_manager, unsigned int eidx, Superblock* superblock);
@@ -30,7 +53,10 @@ void delete_from_bin(BinManager* bin_manager, unsigned int eidx, Superblock* sup
 // Get the emptiness class of a superblock.
 unsigned int get_eidx(Superblock* superblock);
 
-// Update the emptiness class of a superblock, pushing it into the appropriate list.
-void update_emptiness_class(BinManager* bin_manager, unsigned int old_eidx, Superblock* superblock);
+// Emptiness class of the fullest superblocks in the bin that are not full, or -1 if there are none.
+static inline int fullest_nonfull_eidx(BinManager* bin_manager) {
+    unsigned int classes = bin_manager->nonempty_classes & ~1U;
+    return classes != 0 ? __builtin_ctz(classes) : -1;
+}
 
 #endif //MYMALLOC_BINMANAGER_H
@@ -0,0 +1,12 @@
+#ifndef MYMALLOC_DECAY_H
+#define MYMALLOC_DECAY_H
+
+// Time after which recycled superblocks are purged and cached large mappings unmapped, in milliseconds.
+// Negative disables purging.
+// Set from MYMALLOC_DECAY_MS at load time; MYMALLOC_BACKGROUND_PURGE=1 also starts a purging thread.
+extern long decay_ms;
+
+// Milliseconds on a coarse monotonic clock.
+unsigned long now_ms();
+
+#endif //MYMALLOC_DECAY_H
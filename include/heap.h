@@ -4,30 +4,67 @@
 #include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include "macros.h"
 #include "binmanager.h"
+#include "span.h"
+#include "stats.h"
+
+// Allocations and frees of a size class. Thread caches count theirs locally and add them to their heap
+// when they refill or flush.
+typedef struct class_counters {
+    size_t allocs;
+    size_t frees;
+} ClassCounters;
 
 typedef struct heap {
     // Recycling bin for empty superblocks.
     Superblock* recycled_superblock;
+    unsigned long next_purge_ms;  // Earliest time for the next purge pass over the recycling bin
 
     // Bins sorted by size
     BinManager size_bins[MAX_NUM_BINS];
 
+    // Where new superblocks of this heap come from
+    SuperblockChunk sb_chunk;
+
+    // Occupancy over all bins: bit eidx of nonempty_classes is set when some bin has a superblock
+    // in emptiness class eidx, and bins_in_class[eidx] has a bit set for each such bin.
+    unsigned int nonempty_classes;
+    uint64_t bins_in_class[NUM_EMPTINESS_CLASSES][MAX_NUM_BINS / 64];
+
     // Lock for the heap
     pthread_mutex_t mutex;
 
+    // Blocks freed by threads using other heaps. Pushed without the lock, drained by the owner.
+    FreeBlock* remote_free;
+    // Set when a thread using the heap exits, cleared when one allocates from it again. Nothing drains
+    // the remote frees of an orphaned heap, so other threads free into it under its lock instead.
+    bool orphaned;
+
+    // Freed spans kept for reuse by class, most recently freed first
+    SpanNode* span_cache[NUM_SPAN_CLASSES];
+    size_t span_cached_bytes;
+    size_t span_in_use;  // Bytes of spans owned by this heap and allocated
+
     // Usage statistics
     size_t in_use;
     size_t alloced;
     size_t max_in_use;
     size_t max_alloced;
+
+    // Activity counters, read by heap_get_stats
+    ClassCounters class_counters[MAX_NUM_BINS];
+    size_t sb_from_global;
+    size_t sb_to_global;
+    size_t span_allocs;
+    size_t span_frees;
 } Heap;
 
 extern Heap global_heap;
 extern Heap thread_heaps[MAX_HEAPS];
 
-// Get the heap ID of the calling thread based on the TID.
+// Get the heap of the calling thread: by hashing the TID, or with PER_CPU_HEAPS, by the CPU it runs on.
 Heap* get_thread_heap();
 
 // Increase/Decrease the in_use and alloced statistics of the heap
@@ -41,10 +78,44 @@ void dec_alloced(Heap* heap, size_t bytes);
 
 bool is_empty_enough(Heap* heap);
 
+// Release the pages of recycled superblocks and return the cached spans that have been unused for decay_ms,
+// in every heap.
+void purge_all_heaps();
+
+// Called when a thread using heap exits. Returns the heap's recycled and mostly empty superblocks
+// to the global heap and its cached spans to the shared spans, and marks the heap orphaned, unless heaps
+// are per-CPU.
+void heap_thread_exit(Heap* heap);
+
 // Actual allocation/free functions
 void* heap_alloc(Heap* heap, size_t size);
 void heap_free(void* ptr);
 
+// Allocate a block of bin bin_idx with its first size bytes zeroed, clearing them only if the block
+// may have been used before.
+void* heap_calloc(Heap* heap, int bin_idx, size_t size);
+
+// Allocate up to n blocks of bin bin_idx under a single lock, linked into a list at *list.
+// Returns the number of blocks allocated. counts, if not NULL, is added to the heap's counters of the bin
+// and cleared.
+unsigned int heap_alloc_batch(Heap* heap, int bin_idx, unsigned int n, FreeBlock** list, ClassCounters* counts);
+
+// Free a linked list of blocks. Blocks owned by the calling thread's heap, the global heap or an orphaned
+// heap are freed under the owner's lock; blocks owned by other heaps are pushed onto their remote free lists.
+// counts, if not NULL, is added to the counters of bin bin_idx of the calling thread's heap and cleared.
+void heap_free_batch(FreeBlock* list, int bin_idx, ClassCounters* counts);
+
+// Allocate a span for size bytes aligned to alignment (see span_pool_alloc), preferring spans the heap
+// freed recently. If zero is set, the first size bytes are zeroed, clearing only pages that may be dirty.
+void* heap_span_alloc(Heap* heap, size_t size, size_t alignment, bool zero);
+
+// Free a span. It is kept by the heap that owns it, or returned to the shared spans if that heap keeps
+// SPAN_CACHE_MAX_BYTES already.
+void heap_span_free(void* ptr);
+
+// Take a consistent snapshot of a heap's statistics.
+void heap_get_stats(Heap* heap, HeapStats* stats);
+
 // Get block size from allocated ptr
 size_t get_block_size(void* ptr);
 
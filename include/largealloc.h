@@ -3,15 +3,23 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include "stats.h"
 
-// Handles allocation for objects of size greater than S/2
-void* large_alloc(size_t size);
+// Handles allocation for objects larger than SPAN_MAX_SIZE with their own mappings, aligned to alignment
+// (a power of two) and at least to a page. If zero is set, the first size bytes are zeroed.
+void* large_alloc(size_t size, size_t alignment, bool zero);
 
 void* large_realloc(void* ptr, size_t size);
 
 void large_free(void* ptr);
 
-// Determine if a pointer was allocated using large_alloc
-bool is_large_alloc(void* ptr);
+// Unmap the cached freed mappings that have been unused for the decay time
+void purge_large_cache();
+
+// Get the number of usable bytes of a large allocation (its size rounded up to pages)
+size_t large_alloc_size(void* ptr);
+
+// Read the counters of large allocations and the cache.
+void get_large_stats(LargeStats* stats);
 
 #endif //MYMALLOC_LARGEALLOC_H
@@ -2,6 +2,7 @@
 #define MYMALLOC_MACROS_H
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #ifdef MYMALLOC_DEBUG
@@ -15,27 +16,83 @@
 #define LG_MIN_BLOCK_SIZE 4  // 16
 #define LG_SUPERBLOCK_SIZE 18  // 256K
 
+#define LG_SEGMENT_SIZE 26  // 64M
+#define LG_PAGE_SIZE 12  // 4K
+#define LG_HUGE_PAGE_SIZE 21  // 2M
+#define LG_ADDRESS_SPACE 47  // User space virtual addresses
+
 #define MIN_BLOCK_SIZE (1 << LG_MIN_BLOCK_SIZE)
 #define SUPERBLOCK_SIZE (1 << LG_SUPERBLOCK_SIZE)
+#define SEGMENT_SIZE ((size_t) 1 << LG_SEGMENT_SIZE)
+#define PAGE_SIZE (1 << LG_PAGE_SIZE)
+#define HUGE_PAGE_SIZE (1 << LG_HUGE_PAGE_SIZE)
+
+// New superblocks are carved out of chunks owned by a heap. With HUGEPAGE_SEGMENTS, a chunk is a
+// transparent huge page, so superblocks of one heap share TLB entries.
+#ifdef HUGEPAGE_SEGMENTS
+#define SUPERBLOCK_CHUNK_SIZE HUGE_PAGE_SIZE
+#else
+#define SUPERBLOCK_CHUNK_SIZE SUPERBLOCK_SIZE
+#endif
 
 #define LG_MAX_HEAPS 7  // 128
 #define MAX_HEAPS (1 << LG_MAX_HEAPS)
 
 #define MAX_NUM_BINS 128
 #define SIZE_RATIO 1.5
+
+// Size classes per power of two. 0 spaces the classes geometrically by SIZE_RATIO instead.
+#ifndef SIZE_CLASSES_PER_DOUBLING
+#define SIZE_CLASSES_PER_DOUBLING 0
+#endif
 #define MAX_BLOCK_SIZE_THRESHOLD_RATIO 0.8
 
 #define FREE_SB_THRESH 4  // K in the paper
+#define EMPTY_FRAC 0.25  // f in the paper
+
+// Superblocks are tracked by fullness in this many classes (at most 32)
+#ifndef NUM_EMPTINESS_CLASSES
 #define NUM_EMPTINESS_CLASSES 5
-#define EMPTY_FRAC (1 / (double) (NUM_EMPTINESS_CLASSES - 1))
+#endif
 
-#define MMAP_HEADER_MAGIC 0xDEADBEEF
-#define HEADER_MAGIC 0x8BADF00D
+// Recycled superblocks unused this long have their pages released (MYMALLOC_DECAY_MS overrides)
+#define PURGE_DECAY_MS 10000
+#define PURGE_INTERVAL_MIN_MS 10  // Least time between two purge passes over a heap
 
-// Given ptr to buffer and header type, get ptr to header
-#define GET_HEADER_PTR(ptr, header_type) ((header_type*) ((char*) (ptr) - sizeof(header_type)))
+// How pages are released: MADV_DONTNEED drops them at once, MADV_FREE lets the kernel take them lazily
+#ifndef PURGE_ADVICE
+#define PURGE_ADVICE MADV_DONTNEED
+#endif
+
+// Whether released pages read back as zero, which lets calloc skip clearing them
+#define PURGE_ZEROES (PURGE_ADVICE == MADV_DONTNEED)
+
+#define TCACHE_MAX_BLOCKS 64  // Max blocks cached per size class in each thread
+#define TCACHE_MAX_BYTES (32 * 1024)  // Max bytes cached per size class in each thread
+#define CALLOC_HEAP_MIN_SIZE 4096  // calloc takes blocks this large from the heap, which knows which are zero
+
+// Allocations above MAX_BLOCK_SIZE and up to SPAN_MAX_SIZE are runs of pages carved out of span segments
+#define LG_SPAN_MAX_SIZE 25  // 32M
+#define SPAN_MAX_SIZE ((size_t)1 << LG_SPAN_MAX_SIZE)
+#define SPAN_CACHE_MAX_BYTES ((size_t)8 << 20)  // Max bytes of freed spans kept by each heap
+#define SPAN_MAX_ALIGNMENT ((size_t)HUGE_PAGE_SIZE)  // Larger alignments get their own mapping
+#define SPAN_SEGMENT_MAGIC 0x5BA45E67
+
+// Freed large mappings up to LARGE_CACHE_MAX_SIZE are kept for reuse, up to LARGE_CACHE_MAX_BYTES in total,
+// until they have been unused for the decay time
+#define LG_LARGE_CACHE_MAX_SIZE 27  // 128M
+#define LARGE_CACHE_MAX_SIZE ((size_t)1 << LG_LARGE_CACHE_MAX_SIZE)
+#define LARGE_CACHE_MAX_BYTES ((size_t)128 << 20)
+
+// Allocation tracing (see trace.h)
+#define LG_TRACE_BUFFER_EVENTS 14  // Events buffered per thread before the buffer must be flushed
+#define TRACE_FLUSH_INTERVAL_MS 50  // How often the background thread writes buffered events out
+
+#define FOOTPRINT_INTERVAL_MS 100  // Footprint sampling period (MYMALLOC_FOOTPRINT_MS overrides)
+
+#define HEADER_MAGIC 0x8BADF00D
 
-// Given ptr to header and header type, get ptr to buffer
-#define GET_BUFFER_PTR(header_ptr, header_type) ((char*) (header_ptr) + sizeof(header_type))
+// Given ptr to a block, get ptr to the superblock it resides in
+#define GET_SUPERBLOCK(ptr) ((Superblock*) ((uintptr_t) (ptr) & ~(SUPERBLOCK_SIZE - 1)))
 
 #endif //MYMALLOC_MACROS_H
@@ -12,4 +12,46 @@ void* realloc(void* ptr, size_t size);
 
 void free(void* ptr);
 
+int posix_memalign(void** memptr, size_t alignment, size_t size);
+
+void* aligned_alloc(size_t alignment, size_t size);
+
+void* memalign(size_t alignment, size_t size);
+
+void* valloc(size_t size);
+
+void* pvalloc(size_t size);
+
+// Number of bytes usable in an allocation, at least the size requested
+size_t malloc_usable_size(void* ptr);
+
+// Free an allocation of size bytes from malloc, calloc or realloc without looking up its size class
+void free_sized(void* ptr, size_t size);
+
+// Free an allocation of size bytes from aligned_alloc, posix_memalign or memalign with the same alignment
+void free_aligned_sized(void* ptr, size_t alignment, size_t size);
+
+// Allocator-wide statistics in glibc's format. Superblocks and spans count as the arena, large
+// allocations as mmapped chunks.
+struct mallinfo2 mallinfo2();
+
+// Print per-heap, per-size-class and overall statistics to stderr
+void malloc_stats();
+
+// Read one statistic by name into *value. Returns 0, or ENOENT for an unknown name. Names are
+// "heap.<i>.<field>" for thread heap i, "heaps.<field>" summed over the thread heaps and "global.<field>"
+// for the global heap, where field is one of the HeapStats fields in stats.h; "class.<i>.<field>" for size
+// class i over all heaps, with field one of size, superblocks, live_blocks, allocs or frees;
+// "large.<field>" with field one of in_use, cached, allocs or frees; "segments.reserved", "mapped" and
+// "allocated".
+int mymalloc_stat(const char* name, size_t* value);
+
+// Sample about one allocation per rate bytes allocated for the heap profiler (see profiler.h), or stop
+// sampling if rate is 0. Samples already taken stay until their allocations are freed.
+void mymalloc_prof_enable(size_t rate);
+
+// Write the live samples of the heap profiler to path in pprof's legacy heap format. Returns 0 or an
+// errno value.
+int mymalloc_prof_dump(const char* path);
+
 #endif //MYMALLOC_MYMALLOC_H
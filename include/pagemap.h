@@ -0,0 +1,61 @@
+#ifndef MYMALLOC_PAGEMAP_H
+#define MYMALLOC_PAGEMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "macros.h"
+
+// Tells what kind of allocation an address belongs to without touching the memory there.
+// Superblock and span segments are recorded per SEGMENT_SIZE of address space. Large allocations are
+// recorded in a two-level radix tree mapping their first page to the size of their mapping; its leaves
+// are reserved on first use and only the pages of entries in use are ever touched.
+
+typedef enum alloc_kind {
+    ALLOC_FOREIGN,  // Not allocated by us, e.g. before we were preloaded
+    ALLOC_SMALL,  // Block in a superblock
+    ALLOC_SPAN,
+    ALLOC_LARGE,
+} AllocKind;
+
+#define SEGMENT_MAP_SIZE ((size_t) 1 << (LG_ADDRESS_SPACE - LG_SEGMENT_SIZE))
+extern uint8_t segment_map[SEGMENT_MAP_SIZE];
+
+#define LG_PAGEMAP_LEAF_PAGES 18  // Pages covered by each leaf (1G of address space)
+#define PAGEMAP_LEAF_PAGES ((size_t) 1 << LG_PAGEMAP_LEAF_PAGES)
+#define PAGEMAP_ROOT_SIZE ((size_t) 1 << (LG_ADDRESS_SPACE - LG_PAGE_SIZE - LG_PAGEMAP_LEAF_PAGES))
+
+extern size_t* pagemap_root[PAGEMAP_ROOT_SIZE];
+
+// Get the mapping size recorded for the page at ptr, or 0 if there is none.
+static inline size_t pagemap_get(void* ptr) {
+    uintptr_t page = (uintptr_t) ptr >> LG_PAGE_SIZE;
+    if (page >> LG_PAGEMAP_LEAF_PAGES >= PAGEMAP_ROOT_SIZE)
+        return 0;
+
+    size_t* leaf = __atomic_load_n(&pagemap_root[page >> LG_PAGEMAP_LEAF_PAGES], __ATOMIC_ACQUIRE);
+    return leaf == NULL ? 0 : leaf[page & (PAGEMAP_LEAF_PAGES - 1)];
+}
+
+// Record size for the page at ptr. Returns false if the leaf for it could not be allocated.
+bool pagemap_set(void* ptr, size_t size);
+
+// Record the kind of the segments in [segment, segment + size).
+void set_segment_kind(void* segment, size_t size, AllocKind kind);
+
+// Get the kind of segment ptr is in: ALLOC_SMALL, ALLOC_SPAN or ALLOC_FOREIGN if it is in none.
+static inline AllocKind get_segment_kind(void* ptr) {
+    uintptr_t segment = (uintptr_t) ptr >> LG_SEGMENT_SIZE;
+    return segment < SEGMENT_MAP_SIZE ? (AllocKind) segment_map[segment] : ALLOC_FOREIGN;
+}
+
+// Get the kind of allocation a pointer passed to free or realloc belongs to.
+static inline AllocKind classify_ptr(void* ptr) {
+    AllocKind kind = get_segment_kind(ptr);
+    if (kind == ALLOC_FOREIGN && ((uintptr_t) ptr & (PAGE_SIZE - 1)) == 0 && pagemap_get(ptr) != 0)
+        return ALLOC_LARGE;
+
+    return kind;
+}
+
+#endif //MYMALLOC_PAGEMAP_H
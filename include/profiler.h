@@ -0,0 +1,39 @@
+#ifndef MYMALLOC_PROFILER_H
+#define MYMALLOC_PROFILER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "macros.h"
+#include "pagemap.h"
+
+// Sampling heap profiler. About one allocation per prof_rate bytes allocated is sampled: the gaps between
+// samples are drawn from an exponential distribution, so every allocated byte is equally likely to be
+// the one that gets sampled. A sample keeps the call stack of its allocation until it is freed, and
+// mymalloc_prof_dump() writes the live samples out in the legacy pprof heap format.
+// Enabled at load time by MYMALLOC_PROF_RATE (bytes between samples); MYMALLOC_PROF_DUMP names a file
+// to dump to at exit.
+
+#define PROF_MAX_DEPTH 32  // Frames recorded per stack
+
+extern bool prof_enabled;  // New allocations are being sampled
+extern bool prof_sampled;  // Some allocation has been sampled, so frees have to check for samples
+
+// Bytes the calling thread may still allocate before its next sample
+extern __thread long prof_bytes_left __attribute__ ((tls_model ("initial-exec")));
+
+// Record a sample for the allocation of size bytes at ptr, and draw the distance to the next one.
+void prof_sample(void* ptr, size_t size);
+
+// Drop the sample of ptr, already classified as kind, if it has one.
+void prof_free(void* ptr, AllocKind kind);
+
+// Move the sample of a large allocation resized in place or moved by realloc, if it has one.
+void prof_realloc_large(void* old_ptr, void* new_ptr, size_t size);
+
+// Count an allocation towards the next sample. Only a predictable branch when profiling is off.
+static inline void prof_alloc(void* ptr, size_t size) {
+    if (__builtin_expect(prof_enabled, 0) && ptr != NULL && (prof_bytes_left -= (long) size) < 0)
+        prof_sample(ptr, size);
+}
+
+#endif //MYMALLOC_PROFILER_H
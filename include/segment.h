@@ -0,0 +1,31 @@
+#ifndef MYMALLOC_SEGMENT_H
+#define MYMALLOC_SEGMENT_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include "macros.h"
+#include "pagemap.h"
+
+// Reserve size bytes (a multiple of SEGMENT_SIZE) of address space aligned to SEGMENT_SIZE, recording
+// it in the page map as kind. Tries to place it right at hint first, so the kernel merges it with the
+// mapping ending there.
+char* reserve_segment(size_t size, char* hint, AllocKind kind);
+
+// Total bytes of segments reserved. Segments are never released.
+size_t segment_reserved_bytes();
+
+// Hands out aligned chunks of reserved segments without system calls, reserving more as needed.
+// Chunks from the same arena share VMAs.
+typedef struct segment_arena {
+    pthread_mutex_t mutex;
+    char* cursor;  // Next free byte in the current segment
+    char* end;  // End of the current segment
+    AllocKind kind;  // Kind of the allocations carved out of the segments
+} SegmentArena;
+
+#define SEGMENT_ARENA_INITIALIZER(arena_kind) { .mutex = PTHREAD_MUTEX_INITIALIZER, .kind = (arena_kind) }
+
+// Allocate size bytes aligned to size, which must be a power of two no larger than SEGMENT_SIZE.
+void* arena_alloc(SegmentArena* arena, size_t size);
+
+#endif //MYMALLOC_SEGMENT_H
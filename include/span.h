@@ -0,0 +1,87 @@
+#ifndef MYMALLOC_SPAN_H
+#define MYMALLOC_SPAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "macros.h"
+
+// Allocations between MAX_BLOCK_SIZE and SPAN_MAX_SIZE are spans: page runs carved out of span segments.
+// Each span segment starts with a SpanSegment header whose tags describe the first and last page of every
+// span in it, so a freed span can find and merge with its free neighbours.
+
+#define SEGMENT_PAGES (SEGMENT_SIZE / PAGE_SIZE)
+#define NUM_SPAN_CLASSES (4 * (LG_SPAN_MAX_SIZE - LG_PAGE_SIZE))  // Page classes of allocated spans
+#define NUM_SPAN_BINS (4 * (LG_SEGMENT_SIZE - LG_PAGE_SIZE))  // Page classes of free spans
+
+// Tag of the first and last page of a span: its page count, and either SPAN_FREE or the index of the
+// thread heap that owns it, with SPAN_SAMPLED set while the heap profiler holds a sample of it
+#define SPAN_FREE 0x80000000u
+#define SPAN_SAMPLED 0x40000000u
+#define SPAN_TAG(pages, owner) ((uint32_t) (pages) | (uint32_t) (owner) << 16)
+#define SPAN_TAG_PAGES(tag) ((tag) & 0xFFFF)
+#define SPAN_TAG_OWNER(tag) (((tag) >> 16) & 0xFF)
+
+typedef struct span_segment {
+    int magic;
+    uint32_t tags[SEGMENT_PAGES];
+} SpanSegment;
+
+#define SPAN_HEADER_PAGES ((sizeof(SpanSegment) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+// A free span, kept in its first page
+typedef struct span_node {
+    struct span_node* next;
+    struct span_node* prev;
+    size_t pages;
+    unsigned long freed_ms;  // When the span was freed
+    bool purged;  // Whether the pages after the first have been released
+} SpanNode;
+
+// Round a page count up to one of four classes per doubling, returning the class index.
+static inline int page_class(size_t pages, size_t* rounded) {
+    if (pages <= 4) {
+        *rounded = pages;
+        return (int) pages - 1;
+    }
+
+    int lg = 63 - __builtin_clzll(pages - 1);
+    int shift = lg - 2;
+    size_t quarter = (pages - 1) >> shift;  // 4 to 7
+
+    *rounded = (quarter + 1) << shift;
+    return 4 * (lg - 1) + (int) (quarter - 4);
+}
+
+// Get the class of a span holding size bytes, and its page count.
+static inline int get_span_class(size_t size, size_t* pages) {
+    int span_class = page_class((size + PAGE_SIZE - 1) >> LG_PAGE_SIZE, pages);
+    ASSERT(span_class < NUM_SPAN_CLASSES);
+    return span_class;
+}
+
+static inline SpanSegment* get_span_segment(void* ptr) {
+    return (SpanSegment*) ((uintptr_t) ptr & ~(SEGMENT_SIZE - 1));
+}
+
+// Get the tag of an allocated span.
+static inline uint32_t get_span_tag(void* ptr) {
+    SpanSegment* segment = get_span_segment(ptr);
+    return segment->tags[((char*) ptr - (char*) segment) >> LG_PAGE_SIZE];
+}
+
+// Set or clear SPAN_SAMPLED in the tags of an allocated span.
+void set_span_sampled(void* ptr, bool sampled);
+
+// Allocate a span of pages (a class size) aligned to alignment (a power of two, at least PAGE_SIZE and at
+// most SPAN_MAX_ALIGNMENT), owned by thread heap owner, from the spans shared by all heaps. Only the first
+// *dirty_bytes bytes of the span may be nonzero.
+void* span_pool_alloc(size_t pages, size_t alignment, int owner, size_t* dirty_bytes);
+
+// Return a span to the shared spans, merging it with its free neighbours.
+void span_pool_free(void* ptr, size_t pages);
+
+// Release the pages of shared free spans that have been unused for the decay time.
+void purge_span_pool();
+
+#endif //MYMALLOC_SPAN_H
@@ -0,0 +1,66 @@
+#ifndef MYMALLOC_STATS_H
+#define MYMALLOC_STATS_H
+
+#include <stddef.h>
+#include "macros.h"
+
+// Snapshots of the allocator's counters. Each heap is read under its own lock, so the numbers of one heap
+// are consistent with each other, while different heaps may be read at slightly different times.
+// Thread caches count their allocations and frees locally and add them to their heap when they refill
+// or flush, so allocs and frees lag by at most one cache batch per thread.
+
+// A size class in one heap
+typedef struct class_stats {
+    size_t superblocks;  // Superblocks of the class owned by the heap
+    size_t live_blocks;  // Blocks handed out from them, including blocks held by thread caches
+    size_t allocs;  // Blocks allocated by threads using the heap
+    size_t frees;  // Blocks freed by threads using the heap
+} ClassStats;
+
+typedef struct heap_stats {
+    size_t in_use;  // Bytes of blocks handed out
+    size_t alloced;  // Bytes of superblocks owned
+    size_t max_in_use;
+    size_t max_alloced;
+    size_t superblocks;  // Superblocks owned, including empty ones waiting for reuse
+    size_t recycled_superblocks;  // Empty superblocks waiting for reuse
+    size_t sb_from_global;  // Superblocks taken from the global heap
+    size_t sb_to_global;  // Superblocks given to the global heap
+    size_t span_in_use;  // Bytes of allocated spans owned
+    size_t span_cached;  // Bytes of freed spans kept for reuse
+    size_t span_allocs;
+    size_t span_frees;
+    ClassStats classes[MAX_NUM_BINS];
+} HeapStats;
+
+typedef struct large_stats {
+    size_t in_use;  // Bytes of live large allocations, rounded up to pages
+    size_t cached;  // Bytes of freed mappings kept for reuse
+    size_t allocs;
+    size_t frees;
+} LargeStats;
+
+// Totals over the whole allocator
+typedef struct malloc_totals {
+    HeapStats heaps;  // Sum over the thread heaps
+    HeapStats global;  // The global heap
+    LargeStats large;
+    size_t segments;  // Bytes of address space reserved for superblocks and spans
+} MallocTotals;
+
+// Add the stats of one heap into a running sum.
+void add_heap_stats(HeapStats* sum, const HeapStats* stats);
+
+// Take a snapshot of the whole allocator.
+void get_malloc_totals(MallocTotals* totals);
+
+// Bytes handed out to the program: blocks (including those held by thread caches), spans and large allocations
+size_t totals_allocated(const MallocTotals* totals);
+
+// Bytes of superblocks, spans and large mappings held by the heaps, used or kept for reuse
+size_t totals_owned(const MallocTotals* totals);
+
+// Bytes of address space mapped by the allocator
+size_t totals_mapped(const MallocTotals* totals);
+
+#endif //MYMALLOC_STATS_H
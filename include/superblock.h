@@ -3,7 +3,6 @@
 
 #include <stddef.h>
 #include <stdbool.h>
-#include <pthread.h>
 #include "macros.h"
 
 typedef struct heap Heap;
@@ -14,11 +13,11 @@ typedef struct free_block {
 
 typedef struct superblock_header {
     int magic;
-    Heap* owner;  // Owner of this superblock.
-    pthread_mutex_t mutex;
+    Heap* owner;  // Owner of this superblock. Only changed while the owner heap is locked.
 
     size_t block_size;  // Size of each individual block
     unsigned int total_blocks; // Total number of blocks in the suprblock
+    unsigned int sampled_blocks;  // Live blocks the heap profiler holds samples of. Changed atomically.
 
     struct superblock* prev;  // Prev superblock in doubly linked list
     struct superblock* next;  // Next superblock
@@ -29,33 +28,58 @@ typedef struct superblock_header {
 
     char* buffer_start;  // Start of buffer
     char* reap_position;  // Cursor into buffer for reap allocation
+    char* zero_start;  // Everything from here to the end of the superblock is known to be zero
+
+    unsigned long recycled_ms;  // When the superblock last became empty (see decay.h)
+    bool purged;  // Pages after the header have been released since it became empty
 
 } __attribute__ ((aligned (16))) SuperblockHeader;
 
 enum { buffer_size = SUPERBLOCK_SIZE - sizeof(SuperblockHeader) };
 
+// Offset of the first block from the start of the superblock. Blocks are aligned to the largest power
+// of two dividing block_size (up to a page), so power-of-two classes serve aligned allocations.
+static inline size_t buffer_offset(size_t block_size) {
+    size_t alignment = block_size & -block_size;
+    if (alignment > PAGE_SIZE)
+        alignment = PAGE_SIZE;
+    return (sizeof(SuperblockHeader) + alignment - 1) & ~(alignment - 1);
+}
+
+// Part of a SUPERBLOCK_CHUNK_SIZE chunk that a heap has yet to turn into superblocks
+typedef struct superblock_chunk {
+    char* cursor;
+    char* end;
+} SuperblockChunk;
+
 // Superblocks are aligned to SUPERBLOCK_SIZE boundary
 typedef struct superblock {
     SuperblockHeader header;
     char buf[buffer_size];
 } Superblock;
 
-// Allocate and initialize a new superblock.
-Superblock* init_superblock(size_t block_size);
-
-void lock_superblock(Superblock* superblock);
-
-void unlock_superblock(Superblock* superblock);
+// Allocate and initialize a new superblock, taking it from chunk when possible.
+Superblock* init_superblock(SuperblockChunk* chunk, size_t block_size);
 
 // Reuse an existing (and empty) superblock, changing its block size and clearing its free list.
 void reset_superblock(Superblock* superblock, size_t block_size);
 
 void* superblock_alloc(Superblock* superblock);
 
+// Whether the block the next superblock_alloc call hands out is known to be zero: one that has not been
+// reaped since its pages were mapped or purged.
+static inline bool superblock_next_zeroed(Superblock* superblock) {
+    SuperblockHeader* header = &superblock->header;
+    return header->reapable_blocks > 0 && header->reap_position >= header->zero_start;
+}
+
 void superblock_free(Superblock* superblock, void* ptr);
 
 bool is_superblock_empty(Superblock* superblock);
 
+// Release the pages of an empty superblock to the OS, keeping the header and address range.
+void purge_superblock(Superblock* superblock);
+
 // Get number of used bytes
 int used_bytes(Superblock* superblock);
 
@@ -0,0 +1,29 @@
+#ifndef MYMALLOC_THREADCACHE_H
+#define MYMALLOC_THREADCACHE_H
+
+#include "heap.h"
+
+// Per-thread cache of free blocks for each size class. Accessed without locks;
+// refilled from and flushed to the thread's heap in batches.
+typedef struct thread_cache {
+    bool registered;  // True once the thread exit hook is set up for this thread
+    bool disabled;  // True after the thread exit hook ran. Blocks then go straight to the heap.
+
+    FreeBlock* bins[MAX_NUM_BINS];  // LIFO lists of cached blocks
+    unsigned int counts[MAX_NUM_BINS];  // Number of blocks in each list
+    ClassCounters pending[MAX_NUM_BINS];  // Allocations and frees not yet added to the heap's counters
+} ThreadCache;
+
+// Allocate a block of bin bin_idx from the calling thread's cache, refilling it if empty.
+void* tcache_alloc(int bin_idx);
+
+// Same as tcache_alloc, with the first size bytes of the block zeroed.
+void* tcache_calloc(int bin_idx, size_t size);
+
+// Return a small block to the calling thread's cache, flushing it if full.
+void tcache_free(void* ptr);
+
+// Same as tcache_free, for a caller that knows the block's bin.
+void tcache_free_idx(void* ptr, int bin_idx);
+
+#endif //MYMALLOC_THREADCACHE_H
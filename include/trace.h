@@ -0,0 +1,54 @@
+#ifndef MYMALLOC_TRACE_H
+#define MYMALLOC_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Allocation trace recorder. With MYMALLOC_TRACE set to a file name, every malloc, calloc, realloc,
+// aligned allocation and free is recorded with its size, thread and time. Each thread appends to its
+// own ring buffer without locks; a background thread, or a thread that finds its buffer full, writes the
+// buffered events to the file. benchmarks/replay re-executes a trace.
+
+// The trace file is a TraceHeader followed by TraceEvents, in the byte order of the machine. Events of
+// one thread are in order; events of different threads are interleaved in chunks, and are ordered by
+// their time stamps.
+#define TRACE_MAGIC 0x4543415254594D4DULL  // "MMYTRACE"
+#define TRACE_VERSION 2
+
+typedef enum trace_op {
+    TRACE_MALLOC,  // ptr = malloc(size)
+    TRACE_CALLOC,  // ptr = calloc(1, size)
+    TRACE_REALLOC,  // ptr = realloc(arg, size)
+    TRACE_MEMALIGN,  // ptr = memalign(arg, size), and the other aligned allocation functions
+    TRACE_FREE,  // free(ptr)
+    TRACE_REALLOC_FREE,  // realloc(ptr, ...) may release ptr; the thread's TRACE_REALLOC follows
+} TraceOp;
+
+typedef struct trace_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t event_size;  // sizeof(TraceEvent)
+} TraceHeader;
+
+typedef struct trace_event {
+    uint64_t time;  // Nanoseconds since tracing started: after allocations, before frees
+    uint64_t ptr;
+    uint64_t size;
+    uint64_t arg;  // Old pointer of a realloc, alignment of an aligned allocation
+    uint32_t thread;  // Threads are numbered from 0 in the order of their first event
+    uint32_t op;
+} TraceEvent;
+
+extern bool trace_enabled;
+
+// Append an event to the calling thread's buffer.
+void trace_record(TraceOp op, void* ptr, size_t size, uintptr_t arg);
+
+// Record an event if tracing. Only a predictable branch otherwise.
+static inline void trace_event(TraceOp op, void* ptr, size_t size, uintptr_t arg) {
+    if (__builtin_expect(trace_enabled, 0))
+        trace_record(op, ptr, size, arg);
+}
+
+#endif //MYMALLOC_TRACE_H
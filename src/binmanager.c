@@ -8,68 +8,9 @@
 #define SET_PREV(superblock, target) (&(superblock)->header)->prev = (target)
 #define SET_NEXT(superblock, target) (&(superblock)->header)->next = (target)
 
-bool size_table_initialized;
-static size_t size_table[MAX_NUM_BINS];  // Stores block size for each bin
-size_t max_block_size;  // Largest block size before large_alloc handles it
-int num_size_bins;
-
-void init_size_table() {
-    size_t half_sb = (SUPERBLOCK_SIZE - sizeof(SuperblockHeader)) / 2;
-    size_t sz = MIN_BLOCK_SIZE;
-    int idx = 0;
-
-    while (1) {
-        size_table[idx] = sz;
-        size_t new_sz = (size_t) ((double) sz * SIZE_RATIO);
-
-        // Align
-        new_sz = new_sz & ~(MIN_BLOCK_SIZE - 1);
-        while (new_sz <= sz)
-            new_sz += MIN_BLOCK_SIZE;
-
-        if (new_sz > half_sb)
-            break;
-
-        ASSERT((new_sz & (MIN_BLOCK_SIZE - 1)) == 0);  // Check proper alignment
-        sz = new_sz;
-        idx++;
-    }
-
-    // If maximum block size is not large enough, add one more
-    size_t max_block_size_threshold = (size_t) ((double) half_sb * MAX_BLOCK_SIZE_THRESHOLD_RATIO);
-    if (sz < max_block_size_threshold) {
-        sz = half_sb;
-        idx++;
-        size_table[idx] = sz;
-    }
-
-    num_size_bins = idx + 1;
-    max_block_size = sz;
-    size_table_initialized = true;
-
-    ASSERT(2 * max_block_size + sizeof(SuperblockHeader) <= SUPERBLOCK_SIZE);  // Check if 2 max_blocks can fit
-    DPRINT("Size table initialized with max_block_size = %zu and with %d bins", max_block_size, num_size_bins);
-}
-
-size_t idx2class(int idx) {
-    return size_table[idx];
-}
-
-int size2idx(size_t size) {
-    int i = 0, j = num_size_bins;
-
-    while (i < j) {
-        int s = i + (j - i) / 2;
-        if (size > size_table[s]) {
-            i = s + 1;
-        } else {
-            j = s;
-        }
-    }
-
-    ASSERT(j >= 0 && j < num_size_bins);
-    return j;
-}
+const size_t size_table[NUM_SIZE_BINS] = SIZE_TABLE_INITIALIZER;
+const unsigned char small_size_lookup[SMALL_LOOKUP_SIZE] = SMALL_LOOKUP_INITIALIZER;
+const unsigned char large_size_lookup[LARGE_LOOKUP_SIZE] = LARGE_LOOKUP_INITIALIZER;
 
 void push_into_bin(BinManager* bin_manager, unsigned int eidx, Superblock* superblock) {
     Superblock* list_head = bin_manager->emptiness_bins[eidx];
@@ -91,6 +32,8 @@ void push_into_bin(BinManager* bin_manager, unsigned int eidx, Superblock* super
         *list_head_ptr = superblock;
     }
 
+    bin_manager->nonempty_classes |= 1U << eidx;
+
     if (eidx > 0)
         bin_manager->num_nonfull_superblocks++;
 }
@@ -104,6 +47,7 @@ void delete_from_bin(BinManager* bin_manager, unsigned int eidx, Superblock* sup
     if (GET_PREV(superblock) == superblock) {
         ASSERT(GET_NEXT(superblock) == superblock);
         *list_head_ptr = NULL;
+        bin_manager->nonempty_classes &= ~(1U << eidx);
     } else {
         // General case
         // If deleting head, make the next element the new head
@@ -136,10 +80,3 @@ unsigned int get_eidx(Superblock* superblock) {
     ASSERT(eidx >= 0 && eidx < NUM_EMPTINESS_CLASSES);
     return eidx;
 }
-
-void update_emptiness_class(BinManager* bin_manager, unsigned int old_eidx, Superblock* superblock) {
-    unsigned int new_eidx = get_eidx(superblock);
-    delete_from_bin(bin_manager, old_eidx, superblock);
-    push_into_bin(bin_manager, new_eidx, superblock);
-    DPRINT("    Re-assigned superblock %p to emptiness class %u", superblock, new_eidx);
-}
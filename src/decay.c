@@ -0,0 +1,46 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include "decay.h"
+#include "heap.h"
+#include "largealloc.h"
+#include "span.h"
+#include "macros.h"
+
+long decay_ms = PURGE_DECAY_MS;
+
+unsigned long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+static void* background_purge(void* arg) {
+    (void) arg;
+    long interval = decay_ms / 2 > PURGE_INTERVAL_MIN_MS ? decay_ms / 2 : PURGE_INTERVAL_MIN_MS;
+    struct timespec ts = { .tv_sec = interval / 1000, .tv_nsec = (interval % 1000) * 1000000 };
+
+    while (1) {
+        nanosleep(&ts, NULL);
+        purge_all_heaps();
+        purge_span_pool();
+        purge_large_cache();
+    }
+    return NULL;
+}
+
+__attribute__ ((constructor))
+static void init_decay() {
+    const char* env = getenv("MYMALLOC_DECAY_MS");
+    if (env != NULL)
+        decay_ms = atol(env);
+
+    env = getenv("MYMALLOC_BACKGROUND_PURGE");
+    if (env != NULL && atoi(env) != 0 && decay_ms >= 0) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, background_purge, NULL) == 0)
+            pthread_detach(thread);
+    }
+
+    DPRINT("Purging recycled superblocks after %ld ms", decay_ms);
+}
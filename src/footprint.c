@@ -0,0 +1,169 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "macros.h"
+#include "stats.h"
+
+// Footprint sampler. With MYMALLOC_FOOTPRINT set to a file name, a background thread records the
+// resident set size and the allocator's own counters every MYMALLOC_FOOTPRINT_MS (FOOTPRINT_INTERVAL_MS
+// by default), one CSV line per sample. At exit it takes a last sample and appends a summary as
+// "# name value" lines:
+//   peak_rss, avg_rss             resident bytes of the process
+//   peak_owned, avg_owned         bytes of superblocks, spans and large mappings held by the allocator
+//   peak_mapped                   address space mapped by the allocator, mostly not resident
+//   peak_allocated, avg_allocated bytes handed out to the program, rounded up to size classes
+//   fragmentation                 avg_owned / avg_allocated
+//   blowup                        peak_rss / peak_allocated; below 1 when the program leaves memory untouched
+//   sb_blowup                     peak over samples of superblock bytes owned / bytes in use (Hoard's a / u)
+
+typedef struct footprint {
+    pthread_mutex_t mutex;
+    int fd;
+    struct timespec start;
+    size_t samples;
+    size_t peak_rss, peak_owned, peak_mapped, peak_allocated;
+    double sum_rss, sum_owned, sum_allocated;
+    double sb_blowup;
+} Footprint;
+
+static Footprint footprint = { .mutex = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+static long footprint_interval_ms = FOOTPRINT_INTERVAL_MS;
+
+// Resident bytes, from /proc/self/statm. Read with plain system calls to stay out of the allocator.
+static size_t resident_bytes() {
+    char buf[128];
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+        return 0;
+    buf[len] = '\0';
+
+    // Total program size, then resident pages
+    char* p = strchr(buf, ' ');
+    return p != NULL ? strtoul(p + 1, NULL, 10) * PAGE_SIZE : 0;
+}
+
+static void footprint_write(const char* line, int len) {
+    if (len > 0 && write(footprint.fd, line, len) != len) {
+        DPRINT("Footprint write failed");
+    }
+}
+
+static void footprint_sample() {
+    MallocTotals totals;
+    get_malloc_totals(&totals);
+    size_t rss = resident_bytes();
+    size_t owned = totals_owned(&totals);
+    size_t mapped = totals_mapped(&totals);
+    size_t allocated = totals_allocated(&totals);
+    size_t sb_in_use = totals.heaps.in_use + totals.global.in_use;
+    size_t sb_alloced = totals.heaps.alloced + totals.global.alloced;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (now.tv_sec - footprint.start.tv_sec) * 1000 + (now.tv_nsec - footprint.start.tv_nsec) / 1000000;
+
+    pthread_mutex_lock(&footprint.mutex);
+    if (footprint.fd < 0) {  // Summarized already
+        pthread_mutex_unlock(&footprint.mutex);
+        return;
+    }
+
+    footprint.samples++;
+    footprint.sum_rss += rss;
+    footprint.sum_owned += owned;
+    footprint.sum_allocated += allocated;
+    if (rss > footprint.peak_rss)
+        footprint.peak_rss = rss;
+    if (owned > footprint.peak_owned)
+        footprint.peak_owned = owned;
+    if (mapped > footprint.peak_mapped)
+        footprint.peak_mapped = mapped;
+    if (allocated > footprint.peak_allocated)
+        footprint.peak_allocated = allocated;
+    if (sb_in_use > 0 && (double) sb_alloced / sb_in_use > footprint.sb_blowup)
+        footprint.sb_blowup = (double) sb_alloced / sb_in_use;
+
+    char line[256];
+    footprint_write(line, snprintf(line, sizeof(line), "%ld,%zu,%zu,%zu,%zu,%zu,%zu\n",
+                                   ms, rss, owned, mapped, allocated, sb_in_use, sb_alloced));
+    pthread_mutex_unlock(&footprint.mutex);
+}
+
+static void* background_sample(void* arg) {
+    (void) arg;
+    struct timespec ts = {
+        .tv_sec = footprint_interval_ms / 1000, .tv_nsec = (footprint_interval_ms % 1000) * 1000000
+    };
+
+    while (1) {
+        nanosleep(&ts, NULL);
+        footprint_sample();
+    }
+    return NULL;
+}
+
+__attribute__ ((destructor))
+static void footprint_summary() {
+    if (footprint.fd < 0)
+        return;
+
+    footprint_sample();
+
+    pthread_mutex_lock(&footprint.mutex);
+    double n = (double) footprint.samples;
+    double avg_allocated = footprint.sum_allocated / n;
+    char buf[1024];
+    int len = snprintf(buf, sizeof(buf),
+                       "# samples %zu\n"
+                       "# peak_rss %zu\n# avg_rss %.0f\n"
+                       "# peak_owned %zu\n# avg_owned %.0f\n# peak_mapped %zu\n"
+                       "# peak_allocated %zu\n# avg_allocated %.0f\n"
+                       "# fragmentation %.3f\n# blowup %.3f\n# sb_blowup %.3f\n",
+                       footprint.samples, footprint.peak_rss, footprint.sum_rss / n,
+                       footprint.peak_owned, footprint.sum_owned / n, footprint.peak_mapped,
+                       footprint.peak_allocated, avg_allocated,
+                       avg_allocated > 0 ? footprint.sum_owned / n / avg_allocated : 0,
+                       footprint.peak_allocated > 0 ? (double) footprint.peak_rss / footprint.peak_allocated : 0,
+                       footprint.sb_blowup);
+    footprint_write(buf, len);
+    close(footprint.fd);
+    footprint.fd = -1;
+    pthread_mutex_unlock(&footprint.mutex);
+}
+
+__attribute__ ((constructor))
+static void init_footprint() {
+    const char* path = getenv("MYMALLOC_FOOTPRINT");
+    if (path == NULL || *path == '\0')
+        return;
+
+    const char* env = getenv("MYMALLOC_FOOTPRINT_MS");
+    if (env != NULL && atol(env) > 0)
+        footprint_interval_ms = atol(env);
+
+    footprint.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (footprint.fd < 0) {
+        perror("mymalloc: cannot open footprint file");
+        return;
+    }
+
+    const char* header = "time_ms,rss,owned,mapped,allocated,sb_in_use,sb_alloced\n";
+    footprint_write(header, (int) strlen(header));
+    clock_gettime(CLOCK_MONOTONIC, &footprint.start);
+    footprint_sample();
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, background_sample, NULL) == 0)
+        pthread_detach(thread);
+
+    DPRINT("Sampling the footprint to %s every %ld ms", path, footprint_interval_ms);
+}
@@ -1,7 +1,16 @@
+#define _GNU_SOURCE
+#include <sched.h>
 #include <stdint.h>
+#include <string.h>
 #include "heap.h"
+#include "decay.h"
 #include "macros.h"
 
+#if defined(PER_CPU_HEAPS) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define HAVE_RSEQ
+#endif
+
 #define HEAP_INITIALIZER { \
     .mutex = PTHREAD_MUTEX_INITIALIZER, \
 }
@@ -9,12 +18,34 @@
 Heap global_heap = HEAP_INITIALIZER;
 Heap thread_heaps[MAX_HEAPS] = {HEAP_INITIALIZER};
 
+#ifdef PER_CPU_HEAPS
+// CPU the calling thread is running on. Read from the rseq area glibc registers for every thread,
+// which the kernel keeps current, falling back to sched_getcpu() when rseq is unavailable.
+// The thread may migrate right after; the heap lock keeps that correct, only less local.
+static unsigned int get_current_cpu() {
+#ifdef HAVE_RSEQ
+    if (__rseq_size > 0) {
+        struct rseq* rseq_area = (struct rseq*) ((char*) __builtin_thread_pointer() + __rseq_offset);
+        int cpu = (int) __atomic_load_n(&rseq_area->cpu_id, __ATOMIC_RELAXED);
+        if (cpu >= 0)
+            return cpu;
+    }
+#endif
+    int cpu = sched_getcpu();
+    return cpu >= 0 ? cpu : 0;
+}
+
+Heap* get_thread_heap() {
+    return &thread_heaps[get_current_cpu() & (MAX_HEAPS - 1)];
+}
+#else
 Heap* get_thread_heap() {
     pthread_t tid = pthread_self();
     unsigned long idx = (tid * 11400714819323198485UL) >> (64 - LG_MAX_HEAPS);  // Knuth hash
     ASSERT(idx >= 0 && idx < MAX_HEAPS);
     return &thread_heaps[idx];
 }
+#endif
 
 void inc_usage(Heap* heap, size_t added_usage) {
     heap->in_use += added_usage;
@@ -46,7 +77,136 @@ static void unlock_heap(Heap* heap) {
     pthread_mutex_unlock(&heap->mutex);
 }
 
-static Superblock* get_sb_from_global(size_t size_class) {
+// Superblock owners only change while the old owner's lock is held, so a heap that
+// is still the owner after being locked stays the owner until it is unlocked.
+static Heap* get_owner(Superblock* superblock) {
+    return __atomic_load_n(&superblock->header.owner, __ATOMIC_ACQUIRE);
+}
+
+static void set_owner(Superblock* superblock, Heap* heap) {
+    __atomic_store_n(&superblock->header.owner, heap, __ATOMIC_RELEASE);
+}
+
+// Lock the heap that owns a superblock.
+static Heap* lock_owner(Superblock* superblock) {
+    while (1) {
+        Heap* heap = get_owner(superblock);
+        lock_heap(heap);
+        if (get_owner(superblock) == heap)
+            return heap;
+        unlock_heap(heap);
+    }
+}
+
+// Bin list updates that keep the heap's occupancy bitmaps in sync.
+static void heap_push_sb(Heap* heap, int bin_idx, unsigned int eidx, Superblock* s_ptr) {
+    push_into_bin(&heap->size_bins[bin_idx], eidx, s_ptr);
+    heap->bins_in_class[eidx][bin_idx / 64] |= 1UL << (bin_idx % 64);
+    heap->nonempty_classes |= 1U << eidx;
+}
+
+static void heap_delete_sb(Heap* heap, int bin_idx, unsigned int eidx, Superblock* s_ptr) {
+    BinManager* bin_manager = &heap->size_bins[bin_idx];
+    delete_from_bin(bin_manager, eidx, s_ptr);
+    if (bin_manager->emptiness_bins[eidx] != NULL)
+        return;
+
+    uint64_t* bins = heap->bins_in_class[eidx];
+    bins[bin_idx / 64] &= ~(1UL << (bin_idx % 64));
+    for (int w = 0; w < MAX_NUM_BINS / 64; w++) {
+        if (bins[w] != 0)
+            return;
+    }
+    heap->nonempty_classes &= ~(1U << eidx);
+}
+
+// Move a superblock to the emptiness class matching its current fullness.
+static void heap_update_sb(Heap* heap, int bin_idx, unsigned int old_eidx, Superblock* s_ptr) {
+    unsigned int new_eidx = get_eidx(s_ptr);
+    if (new_eidx == old_eidx)
+        return;
+
+    heap_delete_sb(heap, bin_idx, old_eidx, s_ptr);
+    heap_push_sb(heap, bin_idx, new_eidx, s_ptr);
+    DPRINT("    Re-assigned superblock %p to emptiness class %u", s_ptr, new_eidx);
+}
+
+// Return the cached spans of a locked heap freed at least min_age ms ago to the shared spans.
+static void release_cached_spans(Heap* heap, unsigned long now, unsigned long min_age) {
+    for (int c = 0; c < NUM_SPAN_CLASSES; c++) {
+        SpanNode** link = &heap->span_cache[c];
+        while (*link != NULL && now - (*link)->freed_ms < min_age)
+            link = &(*link)->next;
+
+        // Everything past the first old span was freed even earlier
+        SpanNode* span = *link;
+        *link = NULL;
+        while (span != NULL) {
+            SpanNode* next = span->next;
+            heap->span_cached_bytes -= span->pages * PAGE_SIZE;
+            span_pool_free(span, span->pages);
+            span = next;
+        }
+    }
+}
+
+// Purge the recycled superblocks of a locked heap that have been empty for decay_ms, and return its
+// spans cached for that long.
+static void purge_heap(Heap* heap, unsigned long now) {
+    // Stored atomically for maybe_purge_global, which reads it without the lock
+    unsigned long interval = decay_ms / 4 > PURGE_INTERVAL_MIN_MS ? decay_ms / 4 : PURGE_INTERVAL_MIN_MS;
+    __atomic_store_n(&heap->next_purge_ms, now + interval, __ATOMIC_RELAXED);
+
+    for (Superblock* s_ptr = heap->recycled_superblock; s_ptr != NULL; s_ptr = s_ptr->header.next) {
+        if (!s_ptr->header.purged && now - s_ptr->header.recycled_ms >= (unsigned long) decay_ms)
+            purge_superblock(s_ptr);
+    }
+
+    if (heap->span_cached_bytes > 0)
+        release_cached_spans(heap, now, decay_ms);
+}
+
+// Purge a locked heap if a purge pass is due.
+static void maybe_purge_heap(Heap* heap) {
+    if (decay_ms < 0 || (heap->recycled_superblock == NULL && heap->span_cached_bytes == 0))
+        return;
+
+    unsigned long now = now_ms();
+    if (now >= heap->next_purge_ms)
+        purge_heap(heap, now);
+}
+
+// Purge the global heap if a purge pass is due. Called without any heap locked. Only the time of the next
+// pass is read before locking; if another thread holds the lock, the pass is left to a later call.
+static void maybe_purge_global() {
+    unsigned long now = now_ms();
+    if (decay_ms < 0 || now < __atomic_load_n(&global_heap.next_purge_ms, __ATOMIC_RELAXED))
+        return;
+
+    if (pthread_mutex_trylock(&global_heap.mutex) != 0)
+        return;
+    purge_heap(&global_heap, now);
+    unlock_heap(&global_heap);
+}
+
+void purge_all_heaps() {
+    if (decay_ms < 0)
+        return;
+
+    for (int i = 0; i < MAX_HEAPS; i++) {
+        Heap* heap = &thread_heaps[i];
+        lock_heap(heap);
+        if (heap->recycled_superblock != NULL || heap->span_cached_bytes > 0)
+            purge_heap(heap, now_ms());
+        unlock_heap(heap);
+    }
+
+    lock_heap(&global_heap);
+    purge_heap(&global_heap, now_ms());
+    unlock_heap(&global_heap);
+}
+
+static Superblock* get_sb_from_global(Heap* heap, size_t size_class) {
     lock_heap(&global_heap);
     Superblock* s_ptr = NULL;
     int bin_idx = size2idx(size_class);
@@ -54,48 +214,44 @@ static Superblock* get_sb_from_global(size_t size_class) {
     BinManager* bin_manager = &global_heap.size_bins[bin_idx];
     Superblock* recycling_bin = global_heap.recycled_superblock;
 
-    if (bin_manager->num_nonfull_superblocks > 0) {
-        int eidx;
+    // Find the fullest superblock with free space
+    int eidx = fullest_nonfull_eidx(bin_manager);
 
-        // Find a superblock with free space
-        for (eidx = 1; eidx < NUM_EMPTINESS_CLASSES; eidx++) {
-            s_ptr = bin_manager->emptiness_bins[eidx];
-            if (s_ptr != NULL) {
-                DPRINT("    Transferring superblock %p from global heap", s_ptr);
-                break;
-            }
-        }
+    if (eidx > 0) {
+        s_ptr = bin_manager->emptiness_bins[eidx];
         ASSERT(s_ptr != NULL);
 
         // Remove it from the global heap
         DPRINT("    Removing superblock %p from global heap (bin %d, eidx %d)", s_ptr, bin_idx, eidx);
-        delete_from_bin(bin_manager, eidx, s_ptr);
+        heap_delete_sb(&global_heap, bin_idx, eidx, s_ptr);
 
     } else if (recycling_bin != NULL) { // Check recycling bin too
         s_ptr = recycling_bin;
-        ASSERT(recycling_bin->header.next != NULL);
-
         global_heap.recycled_superblock = recycling_bin->header.next;
+        reset_superblock(s_ptr, size_class);
         DPRINT("    Removing superblock %p from global heap (recycling bin)", s_ptr);
     }
 
+    // Change the owner while the global heap is still locked
+    if (s_ptr != NULL)
+        set_owner(s_ptr, heap);
+
+    maybe_purge_heap(&global_heap);
     unlock_heap(&global_heap);
     return s_ptr;
 }
 
 static Superblock* find_emptiest_sb(Heap* heap, int* bin_idx, int* eidx) {
-    Superblock* s_ptr = NULL;
-
-    for (int e = NUM_EMPTINESS_CLASSES - 1; e > 0; e--) {
-        for (int b = 0; b < num_size_bins; b++) {
-            BinManager* bin_manager = &heap->size_bins[b];
-            s_ptr = bin_manager->emptiness_bins[e];
-
-            if (s_ptr != NULL) {
-                *bin_idx = b;
-                *eidx = e;
-                return s_ptr;
-            }
+    unsigned int classes = heap->nonempty_classes & ~1U;
+    ASSERT(classes != 0);
+
+    int e = 31 - __builtin_clz(classes);
+    for (int w = 0; w < MAX_NUM_BINS / 64; w++) {
+        uint64_t bins = heap->bins_in_class[e][w];
+        if (bins != 0) {
+            *bin_idx = w * 64 + __builtin_ctzll(bins);
+            *eidx = e;
+            return heap->size_bins[*bin_idx].emptiness_bins[e];
         }
     }
 
@@ -103,6 +259,29 @@ static Superblock* find_emptiest_sb(Heap* heap, int* bin_idx, int* eidx) {
     return NULL;
 }
 
+// Hand a superblock, already removed from the bins of a locked heap, to the global heap.
+// eidx == -1 means it goes into the recycling bin.
+static void give_sb_to_global(Heap* heap, Superblock* s_ptr, int bin_idx, int eidx) {
+    heap->sb_to_global++;
+    dec_usage(heap, used_bytes(s_ptr));
+    dec_alloced(heap, SUPERBLOCK_SIZE);
+
+    lock_heap(&global_heap);
+    set_owner(s_ptr, &global_heap);
+
+    // Insert into global heap.
+    if (eidx == -1) {
+        // Insert into recycling bin.
+        s_ptr->header.next = global_heap.recycled_superblock;
+        global_heap.recycled_superblock = s_ptr;
+    } else {
+        heap_push_sb(&global_heap, bin_idx, eidx, s_ptr);
+    }
+
+    maybe_purge_heap(&global_heap);
+    unlock_heap(&global_heap);
+}
+
 static void transfer_sb_to_global(Heap* heap) {
     Superblock* s_ptr = NULL;
     Superblock* recycling_bin = heap->recycled_superblock;
@@ -120,38 +299,25 @@ static void transfer_sb_to_global(Heap* heap) {
         s_ptr = find_emptiest_sb(heap, &bin_idx, &eidx);
         DPRINT("    Transferring superblock %p from heap %p (bin_idx=%d, eidx=%d) to globl heap..."
             , s_ptr, heap, eidx, bin_idx);
-        delete_from_bin(&heap->size_bins[bin_idx], eidx, s_ptr);
+        heap_delete_sb(heap, bin_idx, eidx, s_ptr);
     }
 
     ASSERT(s_ptr != NULL);
-    lock_heap(&global_heap);
-    s_ptr->header.owner = &global_heap;
-
-    // Insert into global heap.
-    if (eidx == -1) {
-        // Insert into recycling bin.
-        s_ptr->header.next = global_heap.recycled_superblock;
-        global_heap.recycled_superblock = s_ptr;
-    } else {
-        push_into_bin(&global_heap.size_bins[bin_idx], eidx, s_ptr);
-    }
-
-    unlock_heap(&global_heap);
+    give_sb_to_global(heap, s_ptr, bin_idx, eidx);
 }
 
 // Actual allocation/free functions.
-static void* bin_alloc(Heap* heap, BinManager* bin_manager, size_t size_class) {
+static void* bin_alloc(Heap* heap, int bin_idx, size_t size_class, bool* zeroed) {
+    BinManager* bin_manager = &heap->size_bins[bin_idx];
     Superblock* s_ptr = NULL;  // Ptr to the superblock we are allocating from
     bool sb_already_in_bin = false;  // True if the superblock was in the bin before this call
 
-    // Start looking from bin 1 (fullest to emptiest)
-    for (int eidx = 1; eidx < NUM_EMPTINESS_CLASSES; eidx++) {
+    // Take the fullest superblock that is not full
+    int eidx = fullest_nonfull_eidx(bin_manager);
+    if (eidx > 0) {
         s_ptr = bin_manager->emptiness_bins[eidx];
-        if (s_ptr != NULL) {
-            DPRINT("    Allocating from emptiness class %d at superblock %p", eidx, s_ptr);
-            sb_already_in_bin = true;
-            break;
-        }
+        DPRINT("    Allocating from emptiness class %d at superblock %p", eidx, s_ptr);
+        sb_already_in_bin = true;
     }
 
     // Recycle an empty superblock, if there is any.
@@ -168,11 +334,11 @@ static void* bin_alloc(Heap* heap, BinManager* bin_manager, size_t size_class) {
 
     // None found in this bin. Check global heap.
     if (s_ptr == NULL) {
-        s_ptr = get_sb_from_global(size_class);
+        s_ptr = get_sb_from_global(heap, size_class);
 
         // Update stats of this heap
         if (s_ptr != NULL) {
-            s_ptr->header.owner = heap;
+            heap->sb_from_global++;
             inc_usage(heap, used_bytes(s_ptr));
             inc_alloced(heap, SUPERBLOCK_SIZE);
         }
@@ -180,7 +346,7 @@ static void* bin_alloc(Heap* heap, BinManager* bin_manager, size_t size_class) {
 
     // None in global heap either. Allocate a new one.
     if (s_ptr == NULL) {
-        s_ptr = init_superblock(size_class);
+        s_ptr = init_superblock(&heap->sb_chunk, size_class);
         if (s_ptr == NULL)
             return NULL;
 
@@ -191,23 +357,25 @@ static void* bin_alloc(Heap* heap, BinManager* bin_manager, size_t size_class) {
 
     // Allocate from the superblock.
     unsigned int old_eidx = get_eidx(s_ptr);
+    if (zeroed != NULL)
+        *zeroed = superblock_next_zeroed(s_ptr);
     void* ret_ptr = superblock_alloc(s_ptr);
     ASSERT(ret_ptr != NULL);
 
     if (sb_already_in_bin)
-        update_emptiness_class(bin_manager, old_eidx, s_ptr);
+        heap_update_sb(heap, bin_idx, old_eidx, s_ptr);
     else {
         unsigned int new_eidx = get_eidx(s_ptr);
-        push_into_bin(bin_manager, new_eidx, s_ptr);
+        heap_push_sb(heap, bin_idx, new_eidx, s_ptr);
         DPRINT("    Assigned superblock %p to emptiness class %u", s_ptr, new_eidx);
     }
 
     return ret_ptr;
 }
 
-static void bin_free(Heap* heap, BinManager* bin_manager, void* ptr) {
+static void bin_free(Heap* heap, int bin_idx, void* ptr) {
     // Find the superblock the ptr resides in.
-    Superblock* s_ptr = (Superblock*) ((uintptr_t) ptr & ~(SUPERBLOCK_SIZE - 1));
+    Superblock* s_ptr = GET_SUPERBLOCK(ptr);
 
     // Free it from the superblock.
     unsigned int old_eidx = get_eidx(s_ptr);
@@ -215,10 +383,11 @@ static void bin_free(Heap* heap, BinManager* bin_manager, void* ptr) {
 
     // Update the superblock's emptiness class.
     if (is_superblock_empty(s_ptr)) {
-        delete_from_bin(bin_manager, old_eidx, s_ptr);
+        heap_delete_sb(heap, bin_idx, old_eidx, s_ptr);
 
         DPRINT("    Superblock %p is now empty. Recycling it", s_ptr);
         Superblock* recycle_list_head = heap->recycled_superblock;
+        s_ptr->header.recycled_ms = now_ms();
 
         if (recycle_list_head == NULL)
             s_ptr->header.next = NULL;
@@ -227,8 +396,66 @@ static void bin_free(Heap* heap, BinManager* bin_manager, void* ptr) {
         heap->recycled_superblock = s_ptr;
 
     } else {
-        update_emptiness_class(bin_manager, old_eidx, s_ptr);
+        heap_update_sb(heap, bin_idx, old_eidx, s_ptr);
+    }
+}
+
+// Free a block into a superblock owned by (and locked through) heap.
+static void free_block_locked(Heap* heap, Superblock* s_ptr, void* ptr) {
+    size_t size_class = s_ptr->header.block_size;
+    int bin_idx = size2idx(size_class);
+    DPRINT("  Freeing from superblock %p, heap %p, bin %d (size class = %zu)",
+           s_ptr, heap, bin_idx, size_class);
+
+    bin_free(heap, bin_idx, ptr);
+
+    if (heap != &global_heap) {
+        dec_usage(heap, size_class);
+
+        if (is_empty_enough(heap))
+            transfer_sb_to_global(heap);
+    }
+}
+
+// Push a list of blocks, linked from first to last, onto a heap's remote free list.
+static void push_remote_free(Heap* heap, FreeBlock* first, FreeBlock* last) {
+    FreeBlock* head = __atomic_load_n(&heap->remote_free, __ATOMIC_RELAXED);
+    do {
+        last->next = head;
+    } while (!__atomic_compare_exchange_n(&heap->remote_free, &head, first, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Free the blocks other threads pushed onto a locked heap's remote free list.
+// Returns the blocks whose superblock has changed owners since; free them once the heap is unlocked.
+static FreeBlock* drain_remote_free(Heap* heap) {
+    if (__atomic_load_n(&heap->remote_free, __ATOMIC_RELAXED) == NULL)
+        return NULL;
+
+    FreeBlock* list = __atomic_exchange_n(&heap->remote_free, NULL, __ATOMIC_ACQUIRE);
+    FreeBlock* moved = NULL;
+    DPRINT("  Draining remote frees of heap %p", heap);
+
+    while (list != NULL) {
+        FreeBlock* next = list->next;
+        Superblock* s_ptr = GET_SUPERBLOCK(list);
+
+        if (get_owner(s_ptr) == heap) {
+            free_block_locked(heap, s_ptr, list);
+        } else {
+            list->next = moved;
+            moved = list;
+        }
+        list = next;
     }
+
+    return moved;
+}
+
+// Take back a locked heap that a thread is allocating from again.
+static void adopt_heap(Heap* heap) {
+    if (__atomic_load_n(&heap->orphaned, __ATOMIC_RELAXED))
+        __atomic_store_n(&heap->orphaned, false, __ATOMIC_RELAXED);
 }
 
 void* heap_alloc(Heap* heap, size_t size) {
@@ -237,44 +464,318 @@ void* heap_alloc(Heap* heap, size_t size) {
     DPRINT("  Allocating %zu bytes on bin %d (size class = %zu)", size, bin_idx, size_class);
 
     lock_heap(heap);
-    void* ret_ptr = bin_alloc(heap, &heap->size_bins[bin_idx], size_class);
-    inc_usage(heap, size_class);
+    adopt_heap(heap);
+    FreeBlock* moved = drain_remote_free(heap);
+    maybe_purge_heap(heap);
+    void* ret_ptr = bin_alloc(heap, bin_idx, size_class, NULL);
+    if (ret_ptr != NULL) {
+        inc_usage(heap, size_class);
+        heap->class_counters[bin_idx].allocs++;
+    }
 
     unlock_heap(heap);
+    maybe_purge_global();
+    if (moved != NULL)
+        heap_free_batch(moved, 0, NULL);
+    return ret_ptr;
+}
+
+void* heap_calloc(Heap* heap, int bin_idx, size_t size) {
+    size_t size_class = idx2class(bin_idx);
+    bool zeroed;
+    DPRINT("  Allocating %zu zeroed bytes on bin %d (size class = %zu)", size, bin_idx, size_class);
+
+    lock_heap(heap);
+    adopt_heap(heap);
+    FreeBlock* moved = drain_remote_free(heap);
+    maybe_purge_heap(heap);
+    void* ret_ptr = bin_alloc(heap, bin_idx, size_class, &zeroed);
+    if (ret_ptr != NULL) {
+        inc_usage(heap, size_class);
+        heap->class_counters[bin_idx].allocs++;
+    }
+
+    unlock_heap(heap);
+    maybe_purge_global();
+    if (moved != NULL)
+        heap_free_batch(moved, 0, NULL);
+
+    if (ret_ptr != NULL && !zeroed)
+        memset(ret_ptr, 0, size);
     return ret_ptr;
 }
 
+// Add a thread cache's counts of a bin to a locked heap.
+static void add_class_counters(Heap* heap, int bin_idx, ClassCounters* counts) {
+    heap->class_counters[bin_idx].allocs += counts->allocs;
+    heap->class_counters[bin_idx].frees += counts->frees;
+    counts->allocs = counts->frees = 0;
+}
+
+unsigned int heap_alloc_batch(Heap* heap, int bin_idx, unsigned int n, FreeBlock** list, ClassCounters* counts) {
+    size_t size_class = idx2class(bin_idx);
+    FreeBlock** tail = list;
+    unsigned int count;
+    DPRINT("  Allocating %u blocks on bin %d (size class = %zu)", n, bin_idx, size_class);
+
+    lock_heap(heap);
+    adopt_heap(heap);
+    FreeBlock* moved = drain_remote_free(heap);
+    maybe_purge_heap(heap);
+    for (count = 0; count < n; count++) {
+        FreeBlock* block = bin_alloc(heap, bin_idx, size_class, NULL);
+        if (block == NULL)
+            break;
+
+        *tail = block;
+        tail = &block->next;
+    }
+
+    *tail = NULL;
+    inc_usage(heap, count * size_class);
+    if (counts != NULL)
+        add_class_counters(heap, bin_idx, counts);
+    unlock_heap(heap);
+    maybe_purge_global();
+
+    if (moved != NULL)
+        heap_free_batch(moved, 0, NULL);
+    return count;
+}
+
 size_t get_block_size(void* ptr) {
-    Superblock* s_ptr = (Superblock*) ((uintptr_t) ptr & ~(SUPERBLOCK_SIZE - 1));
-    return s_ptr->header.block_size;
+    return GET_SUPERBLOCK(ptr)->header.block_size;
 }
 
 void heap_free(void* ptr) {
     // Find the superblock the ptr resides in.
-    Superblock* s_ptr = (Superblock*) ((uintptr_t) ptr & ~(SUPERBLOCK_SIZE - 1));
-    lock_superblock(s_ptr);
+    Superblock* s_ptr = GET_SUPERBLOCK(ptr);
+    Heap* heap = lock_owner(s_ptr);
 
-    size_t size_class = s_ptr->header.block_size;
-    int bin_idx = size2idx(size_class);
+    free_block_locked(heap, s_ptr, ptr);
+    unlock_heap(heap);
+}
 
-    Heap* heap = s_ptr->header.owner;
-    DPRINT("  Freeing from superblock %p, heap %p, bin %d (size class = %zu)",
-           s_ptr, heap, bin_idx, size_class);
+void heap_free_batch(FreeBlock* list, int bin_idx, ClassCounters* counts) {
+    Heap* thread_heap = get_thread_heap();
+    Heap* heap = NULL;  // Currently locked heap
+
+    while (list != NULL) {
+        FreeBlock* next = list->next;
+        Superblock* s_ptr = GET_SUPERBLOCK(list);
+        Heap* owner = get_owner(s_ptr);
+
+        // Hand blocks of other thread heaps to their owner, as one chain per run of blocks.
+        if (owner != heap && owner != thread_heap && owner != &global_heap &&
+            !__atomic_load_n(&owner->orphaned, __ATOMIC_RELAXED)) {
+            FreeBlock* last = list;
+            while (next != NULL && get_owner(GET_SUPERBLOCK(next)) == owner) {
+                last = next;
+                next = next->next;
+            }
 
-    lock_heap(heap);
-    bin_free(heap, &heap->size_bins[bin_idx], ptr);
+            DPRINT("  Pushing remote frees onto heap %p", owner);
+            push_remote_free(owner, list, last);
+
+            // The owner may have been orphaned after its remote frees were last drained
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&owner->orphaned, __ATOMIC_RELAXED)) {
+                if (heap != NULL)
+                    unlock_heap(heap);
+                heap = owner;
+                lock_heap(heap);
+                FreeBlock* moved = drain_remote_free(heap);
+                if (moved != NULL) {
+                    FreeBlock* tail = moved;
+                    while (tail->next != NULL)
+                        tail = tail->next;
+                    tail->next = next;
+                    next = moved;
+                }
+            }
+            list = next;
+            continue;
+        }
 
-    if (heap != &global_heap) {
-        dec_usage(heap, size_class);
+        // Keep the lock as long as the blocks belong to the same heap.
+        if (heap == NULL || owner != heap) {
+            if (heap != NULL)
+                unlock_heap(heap);
+            heap = lock_owner(s_ptr);
+        }
 
-        if (is_empty_enough(heap)) {
-            transfer_sb_to_global(heap);
-            dec_alloced(heap, SUPERBLOCK_SIZE);
+        free_block_locked(heap, s_ptr, list);
+        list = next;
+    }
+
+    // Usually the calling thread's heap is still locked
+    if (counts != NULL) {
+        if (heap != thread_heap) {
+            if (heap != NULL)
+                unlock_heap(heap);
+            heap = thread_heap;
+            lock_heap(heap);
         }
+        add_class_counters(heap, bin_idx, counts);
+    }
+
+    if (heap != NULL)
+        unlock_heap(heap);
+}
+
+void heap_thread_exit(Heap* heap) {
+#ifdef PER_CPU_HEAPS
+    // Per-CPU heaps outlive the threads that use them.
+    (void) heap;
+#else
+    // Orphan the heap before the last drain: frees pushed after it see the flag and drain the heap themselves.
+    lock_heap(heap);
+    __atomic_store_n(&heap->orphaned, true, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    FreeBlock* moved = drain_remote_free(heap);
+    DPRINT("  Releasing free superblocks of heap %p", heap);
+
+    while (heap->recycled_superblock != NULL) {
+        Superblock* s_ptr = heap->recycled_superblock;
+        heap->recycled_superblock = s_ptr->header.next;
+        give_sb_to_global(heap, s_ptr, -1, -1);
+    }
+
+    // Superblocks less than half full
+    for (int b = 0; b < NUM_SIZE_BINS; b++) {
+        BinManager* bin_manager = &heap->size_bins[b];
+        for (int e = NUM_EMPTINESS_CLASSES - 1; e > (NUM_EMPTINESS_CLASSES - 1) / 2; e--) {
+            Superblock* s_ptr;
+            while ((s_ptr = bin_manager->emptiness_bins[e]) != NULL) {
+                heap_delete_sb(heap, b, e, s_ptr);
+                give_sb_to_global(heap, s_ptr, b, e);
+            }
+        }
+    }
+
+    release_cached_spans(heap, 0, 0);
+    unlock_heap(heap);
+    if (moved != NULL)
+        heap_free_batch(moved, 0, NULL);
+#endif
+}
+
+void* heap_span_alloc(Heap* heap, size_t size, size_t alignment, bool zero) {
+    size_t pages;
+    int span_class = get_span_class(size, &pages);
+    size_t bytes = pages * PAGE_SIZE;
+
+    lock_heap(heap);
+    maybe_purge_heap(heap);
+
+    // The most recently freed span of the class, if it is aligned
+    SpanNode* span = heap->span_cache[span_class];
+    if (span != NULL && ((uintptr_t) span & (alignment - 1)) != 0)
+        span = NULL;
+
+    if (span != NULL) {
+        heap->span_cache[span_class] = span->next;
+        heap->span_cached_bytes -= bytes;
+    }
+    heap->span_in_use += bytes;
+    heap->span_allocs++;
+    unlock_heap(heap);
+
+    if (span != NULL) {
+        DPRINT("  Reusing span %p of %zu pages", span, pages);
+        if (zero)
+            memset(span, 0, size);
+        return span;
+    }
+
+    size_t dirty_bytes;
+    void* ptr = span_pool_alloc(pages, alignment, (int) (heap - thread_heaps), &dirty_bytes);
+    if (ptr == NULL) {
+        lock_heap(heap);
+        heap->span_in_use -= bytes;
+        heap->span_allocs--;
+        unlock_heap(heap);
+    } else if (zero) {
+        memset(ptr, 0, dirty_bytes < size ? dirty_bytes : size);
+    }
+    return ptr;
+}
+
+void heap_span_free(void* ptr) {
+    uint32_t tag = get_span_tag(ptr);
+    size_t pages = SPAN_TAG_PAGES(tag);
+    size_t bytes = pages * PAGE_SIZE;
+    Heap* heap = &thread_heaps[SPAN_TAG_OWNER(tag)];
+    ASSERT(!(tag & SPAN_FREE));
+
+    lock_heap(heap);
+    heap->span_in_use -= bytes;
+    heap->span_frees++;
+
+    bool cached = decay_ms != 0 && heap->span_cached_bytes + bytes <= SPAN_CACHE_MAX_BYTES;
+    if (cached) {
+        size_t rounded;
+        int span_class = page_class(pages, &rounded);
+        SpanNode* span = ptr;
+        span->pages = pages;
+        span->freed_ms = now_ms();
+        span->next = heap->span_cache[span_class];
+        heap->span_cache[span_class] = span;
+        heap->span_cached_bytes += bytes;
+    }
+
+    maybe_purge_heap(heap);
+    unlock_heap(heap);
+
+    if (!cached)
+        span_pool_free(ptr, pages);
+}
+
+// Count the superblocks and live blocks of a bin of a locked heap.
+static void count_bin(BinManager* bin_manager, ClassStats* stats) {
+    for (int e = 0; e < NUM_EMPTINESS_CLASSES; e++) {
+        Superblock* head = bin_manager->emptiness_bins[e];
+        if (head == NULL)
+            continue;
+
+        // The lists are circular
+        Superblock* s_ptr = head;
+        do {
+            stats->superblocks++;
+            stats->live_blocks += s_ptr->header.total_blocks - s_ptr->header.num_free_blocks;
+            s_ptr = s_ptr->header.next;
+        } while (s_ptr != head);
+    }
+}
+
+void heap_get_stats(Heap* heap, HeapStats* stats) {
+    memset(stats, 0, sizeof(HeapStats));
+    lock_heap(heap);
+
+    stats->in_use = heap->in_use;
+    stats->alloced = heap->alloced;
+    stats->max_in_use = heap->max_in_use;
+    stats->max_alloced = heap->max_alloced;
+    stats->sb_from_global = heap->sb_from_global;
+    stats->sb_to_global = heap->sb_to_global;
+    stats->span_in_use = heap->span_in_use;
+    stats->span_cached = heap->span_cached_bytes;
+    stats->span_allocs = heap->span_allocs;
+    stats->span_frees = heap->span_frees;
+
+    for (Superblock* s_ptr = heap->recycled_superblock; s_ptr != NULL; s_ptr = s_ptr->header.next)
+        stats->recycled_superblocks++;
+    stats->superblocks = stats->recycled_superblocks;
+
+    for (int b = 0; b < NUM_SIZE_BINS; b++) {
+        ClassStats* class_stats = &stats->classes[b];
+        count_bin(&heap->size_bins[b], class_stats);
+        class_stats->allocs = heap->class_counters[b].allocs;
+        class_stats->frees = heap->class_counters[b].frees;
+        stats->superblocks += class_stats->superblocks;
     }
 
     unlock_heap(heap);
-    unlock_superblock(s_ptr);
 }
 
 bool is_empty_enough(Heap* heap) {
@@ -1,73 +1,328 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <sys/mman.h>
 
+#include "decay.h"
 #include "macros.h"
 #include "heap.h"
 #include "largealloc.h"
+#include "pagemap.h"
+#include "span.h"
 #include "string.h"
 
-typedef struct mmap_header {
-    int magic;
-    size_t size;  // Size of the allocated memory
-} MmapHeader;
+// Large allocations keep no header: the size of each mapping is recorded in the page map, keyed by its
+// first page. Mappings of at least HUGE_PAGE_SIZE are aligned to it so they can use huge pages.
 
-void* large_alloc(size_t size) {
-    size_t alloced_size = size + sizeof(MmapHeader);
-    void* ptr = mmap(NULL, alloced_size, PROT_READ | PROT_WRITE,
-                     MAP_PRIVATE | MAP_ANON, -1, 0);
+// Cached mappings are binned by page count rounded down, four bins per doubling
+#define NUM_LARGE_CACHE_BINS (4 * (LG_LARGE_CACHE_MAX_SIZE - LG_PAGE_SIZE))
 
+// A freed mapping kept for reuse. Lives at the start of the mapping itself.
+typedef struct cached_mapping {
+    struct cached_mapping* next;
+    size_t size;  // Size of the mapping
+    unsigned long freed_ms;
+} CachedMapping;
+
+typedef struct large_cache {
+    pthread_mutex_t mutex;
+    CachedMapping* bins[NUM_LARGE_CACHE_BINS];  // Most recently freed first
+    uint64_t nonempty_bins;  // Bit i is set when bins[i] is not empty
+    // Written under the lock with atomic stores, so that they can be read without it to skip locking
+    size_t cached_bytes;
+    unsigned long next_purge_ms;
+} LargeCache;
+
+static LargeCache large_cache = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+// Counters for get_large_stats, updated atomically
+static size_t large_in_use;
+static size_t large_allocs;
+static size_t large_frees;
+
+_Static_assert(NUM_LARGE_CACHE_BINS <= 64, "Cache bins must fit in nonempty_bins");
+
+// Size of the mapping holding an allocation of size bytes
+static size_t mapped_size(size_t size) {
+    return (size + PAGE_SIZE - 1) & ~((size_t) PAGE_SIZE - 1);
+}
+
+static size_t mapping_alignment(size_t alloced_size) {
+    return alloced_size >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : PAGE_SIZE;
+}
+
+// Cache bin of a mapping, rounded down so every mapping in a bin is at least the bin's class size.
+// Returns -1 if the mapping is too large to cache.
+static int cache_bin(size_t alloced_size) {
+    if (alloced_size > LARGE_CACHE_MAX_SIZE)
+        return -1;
+
+    size_t pages = alloced_size >> LG_PAGE_SIZE;
+    size_t rounded;
+    int bin = page_class(pages, &rounded);
+    return rounded == pages ? bin : bin - 1;
+}
+
+// Map size bytes aligned to alignment, trimming the excess.
+static void* map_aligned(size_t size, size_t alignment) {
+    size_t padded_size = size + alignment - PAGE_SIZE;
+    char* ptr = mmap(NULL, padded_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
     if (ptr == MAP_FAILED) {
         perror("mmap failed");
         return NULL;
     }
 
-    DPRINT("large_alloc(): Allocated %zu bytes (%zu with header) at %p",
-           size, alloced_size, ptr);
+    char* aligned_ptr = (char*) (((uintptr_t) ptr + alignment - 1) & ~(uintptr_t) (alignment - 1));
+    if (aligned_ptr > ptr)
+        munmap(ptr, aligned_ptr - ptr);
+    if (aligned_ptr + size < ptr + padded_size)
+        munmap(aligned_ptr + size, ptr + padded_size - (aligned_ptr + size));
 
-    // Place the header at the pointer
-    MmapHeader* header = ptr;
-    header->magic = MMAP_HEADER_MAGIC;
-    header->size = size;
+    return aligned_ptr;
+}
 
-    return GET_BUFFER_PTR(header, MmapHeader);
+// Change the cached byte count. Called with the cache locked.
+static void add_cached_bytes(size_t bytes) {
+    __atomic_store_n(&large_cache.cached_bytes, large_cache.cached_bytes + bytes, __ATOMIC_RELAXED);
 }
 
-void* large_realloc(void* ptr, size_t size) {
-    MmapHeader* old_header = GET_HEADER_PTR(ptr, MmapHeader);
-    size_t old_alloced_size = old_header->size + sizeof(MmapHeader);
-    size_t new_alloced_size = size + sizeof(MmapHeader);
+static void sub_cached_bytes(size_t bytes) {
+    __atomic_store_n(&large_cache.cached_bytes, large_cache.cached_bytes - bytes, __ATOMIC_RELAXED);
+}
 
-    void* new_ptr = mmap(NULL, new_alloced_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (new_ptr == MAP_FAILED) {
-        perror("mmap failed");
+static bool large_cache_empty() {
+    return __atomic_load_n(&large_cache.cached_bytes, __ATOMIC_RELAXED) == 0;
+}
+
+// Unmap the cached mappings unused for the decay time. Called with the cache locked; the expired
+// mappings are linked into *expired for the caller to unmap once the lock is dropped.
+static void purge_large_cache_locked(unsigned long now, CachedMapping** expired) {
+    unsigned long interval = decay_ms / 4 > PURGE_INTERVAL_MIN_MS ? decay_ms / 4 : PURGE_INTERVAL_MIN_MS;
+    __atomic_store_n(&large_cache.next_purge_ms, now + interval, __ATOMIC_RELAXED);
+
+    for (int bin = 0; bin < NUM_LARGE_CACHE_BINS; bin++) {
+        CachedMapping** link = &large_cache.bins[bin];
+        while (*link != NULL && now - (*link)->freed_ms < (unsigned long) decay_ms)
+            link = &(*link)->next;
+
+        // Everything past the first expired mapping was freed even earlier
+        CachedMapping* mapping = *link;
+        *link = NULL;
+        if (large_cache.bins[bin] == NULL)
+            large_cache.nonempty_bins &= ~((uint64_t) 1 << bin);
+
+        while (mapping != NULL) {
+            CachedMapping* next = mapping->next;
+            sub_cached_bytes(mapping->size);
+            mapping->next = *expired;
+            *expired = mapping;
+            mapping = next;
+        }
+    }
+}
+
+// Unmap the cached mappings unused for the decay time, if a purge pass is due.
+static void maybe_purge_large_cache(bool force) {
+    if (decay_ms < 0 || large_cache_empty())
+        return;
+
+    unsigned long now = now_ms();
+    if (!force && now < __atomic_load_n(&large_cache.next_purge_ms, __ATOMIC_RELAXED))
+        return;
+
+    CachedMapping* expired = NULL;
+    pthread_mutex_lock(&large_cache.mutex);
+    purge_large_cache_locked(now, &expired);
+    pthread_mutex_unlock(&large_cache.mutex);
+
+    while (expired != NULL) {
+        CachedMapping* next = expired->next;
+        DPRINT("      Unmapping cached mapping %p of %zu bytes", expired, expired->size);
+        if (munmap(expired, expired->size) == -1)
+            perror("munmap failed");
+        expired = next;
+    }
+}
+
+void purge_large_cache() {
+    maybe_purge_large_cache(true);
+}
+
+// Take a mapping of at least alloced_size bytes from the cache, or NULL if it has none.
+// Sets *mapping_size to the size of the cached mapping.
+static void* take_cached_mapping(size_t alloced_size, size_t* mapping_size) {
+    int bin = cache_bin(alloced_size);
+    if (bin < 0 || large_cache_empty())
         return NULL;
+
+    pthread_mutex_lock(&large_cache.mutex);
+
+    // Mappings in the bin of the size itself may be smaller; those in later bins all fit
+    CachedMapping** link = &large_cache.bins[bin];
+    while (*link != NULL && (*link)->size < alloced_size)
+        link = &(*link)->next;
+
+    uint64_t later_bins = large_cache.nonempty_bins & (~(uint64_t) 1 << bin);
+    if (*link == NULL && later_bins != 0) {
+        bin = __builtin_ctzll(later_bins);
+        link = &large_cache.bins[bin];
     }
 
-    memcpy(new_ptr, old_header, old_alloced_size);
-    munmap(old_header, old_alloced_size);
+    CachedMapping* mapping = *link;
+    if (mapping != NULL) {
+        *link = mapping->next;
+        if (large_cache.bins[bin] == NULL)
+            large_cache.nonempty_bins &= ~((uint64_t) 1 << bin);
 
-    DPRINT("large_realloc(): Allocated %zu bytes (%zu with header) at %p",
-           size, new_alloced_size, new_ptr);
+        sub_cached_bytes(mapping->size);
+        *mapping_size = mapping->size;
+    }
+    pthread_mutex_unlock(&large_cache.mutex);
 
-    // Place the header at the pointer
-    MmapHeader* new_header = new_ptr;
-    new_header->magic = MMAP_HEADER_MAGIC;
-    new_header->size = size;
+    return mapping;
+}
 
-    return GET_BUFFER_PTR(new_header, MmapHeader);
+// Keep a freed mapping for reuse. Returns false if it does not fit in the cache.
+static bool cache_mapping(void* ptr, size_t alloced_size) {
+    int bin = cache_bin(alloced_size);
+    if (bin < 0 || decay_ms == 0)
+        return false;
+
+    bool cached = false;
+    pthread_mutex_lock(&large_cache.mutex);
+    if (large_cache.cached_bytes + alloced_size <= LARGE_CACHE_MAX_BYTES) {
+        CachedMapping* mapping = ptr;
+        mapping->size = alloced_size;
+        mapping->freed_ms = now_ms();
+        mapping->next = large_cache.bins[bin];
+        large_cache.bins[bin] = mapping;
+        large_cache.nonempty_bins |= (uint64_t) 1 << bin;
+        add_cached_bytes(alloced_size);
+        cached = true;
+    }
+    pthread_mutex_unlock(&large_cache.mutex);
+
+    return cached;
+}
+
+void* large_alloc(size_t size, size_t alignment, bool zero) {
+    size_t alloced_size = mapped_size(size);
+    size_t cached_size;
+
+    // Sizes past the largest object would wrap around when rounded up and padded for alignment
+    if (size > PTRDIFF_MAX - alignment) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Cached mappings are only known to have the default alignment
+    if (alignment < mapping_alignment(alloced_size))
+        alignment = mapping_alignment(alloced_size);
+    bool use_cache = alignment == mapping_alignment(alloced_size);
+
+    char* ptr = use_cache ? take_cached_mapping(alloced_size, &cached_size) : NULL;
+    if (ptr != NULL) {
+        DPRINT("large_alloc(): Reusing cached mapping at %p of %zu bytes for %zu bytes", ptr, cached_size, size);
+
+        // Give back the pages past the requested size
+        if (cached_size > alloced_size)
+            munmap(ptr + alloced_size, cached_size - alloced_size);
+
+        // New mappings are zero, cached ones have been used
+        if (zero)
+            memset(ptr, 0, size);
+    } else {
+        ptr = map_aligned(alloced_size, alignment);
+        if (ptr == NULL)
+            return NULL;
+
+        DPRINT("large_alloc(): Allocated %zu bytes (%zu mapped) at %p", size, alloced_size, ptr);
+    }
+
+    if (!pagemap_set(ptr, alloced_size)) {
+        munmap(ptr, alloced_size);
+        return NULL;
+    }
+
+    __atomic_add_fetch(&large_in_use, alloced_size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&large_allocs, 1, __ATOMIC_RELAXED);
+
+    maybe_purge_large_cache(false);
+    return ptr;
+}
+
+void* large_realloc(void* ptr, size_t size) {
+    size_t old_alloced_size = pagemap_get(ptr);
+    size_t new_alloced_size = mapped_size(size);
+
+    // The mapping already has the right number of pages
+    if (old_alloced_size == new_alloced_size)
+        return ptr;
+
+    // Resize in place if the address range allows, which keeps the alignment
+    char* new_ptr = mremap(ptr, old_alloced_size, new_alloced_size, 0);
+    if (new_ptr != MAP_FAILED) {
+        pagemap_set(ptr, new_alloced_size);  // The leaf exists
+    } else {
+        // Let the kernel move the pages into a new aligned mapping instead of copying them
+        char* target = map_aligned(new_alloced_size, mapping_alignment(new_alloced_size));
+        if (target == NULL)
+            return NULL;
+
+        if (!pagemap_set(target, new_alloced_size)) {
+            munmap(target, new_alloced_size);
+            return NULL;
+        }
+
+        // The move releases the old range, which another thread may map at once: clear its entry first
+        pagemap_set(ptr, 0);
+        new_ptr = mremap(ptr, old_alloced_size, old_alloced_size, MREMAP_MAYMOVE | MREMAP_FIXED, target);
+        if (new_ptr == MAP_FAILED) {
+            perror("mremap failed");
+            pagemap_set(ptr, old_alloced_size);
+            pagemap_set(target, 0);
+            munmap(target, new_alloced_size);
+            return NULL;
+        }
+    }
+
+    DPRINT("large_realloc(): Remapped %zu bytes (%zu mapped) from %p to %p",
+           size, new_alloced_size, ptr, new_ptr);
+
+    __atomic_add_fetch(&large_in_use, new_alloced_size - old_alloced_size, __ATOMIC_RELAXED);
+    return new_ptr;
 }
 
 void large_free(void* ptr) {
-    MmapHeader* header = GET_HEADER_PTR(ptr, MmapHeader);
-    size_t alloced_size = header->size + sizeof(MmapHeader);
-    DPRINT("large_free(): Freeing %zu bytes (%zu with header) at %p",
-           header->size, alloced_size, header);
+    size_t alloced_size = pagemap_get(ptr);
+    pagemap_set(ptr, 0);
+    __atomic_sub_fetch(&large_in_use, alloced_size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&large_frees, 1, __ATOMIC_RELAXED);
+
+    if (cache_mapping(ptr, alloced_size)) {
+        DPRINT("large_free(): Caching %zu bytes at %p", alloced_size, ptr);
+        maybe_purge_large_cache(false);
+        return;
+    }
+
+    DPRINT("large_free(): Freeing %zu bytes at %p", alloced_size, ptr);
 
-    int ret = munmap(header, alloced_size);
+    int ret = munmap(ptr, alloced_size);
     if (ret == -1)
         perror("munmap failed");
 }
 
-bool is_large_alloc(void* ptr) {
-    MmapHeader* header = GET_HEADER_PTR(ptr, MmapHeader);
-    return header->magic == MMAP_HEADER_MAGIC;
-}
\ No newline at end of file
+size_t large_alloc_size(void* ptr) {
+    return pagemap_get(ptr);
+}
+
+void get_large_stats(LargeStats* stats) {
+    stats->in_use = __atomic_load_n(&large_in_use, __ATOMIC_RELAXED);
+    stats->allocs = __atomic_load_n(&large_allocs, __ATOMIC_RELAXED);
+    stats->frees = __atomic_load_n(&large_frees, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&large_cache.mutex);
+    stats->cached = large_cache.cached_bytes;
+    pthread_mutex_unlock(&large_cache.mutex);
+}
@@ -1,22 +1,117 @@
+#include <errno.h>
 #include <stdint.h>
 #include <string.h>
 #include "mymalloc.h"
 #include "largealloc.h"
+#include "pagemap.h"
 #include "binmanager.h"
+#include "heap.h"
+#include "profiler.h"
+#include "span.h"
+#include "threadcache.h"
+#include "trace.h"
 
-void* malloc(size_t size) {
+// malloc without tracing, for the functions that record their own event
+static void* alloc(size_t size) {
     if (size == 0)
         return NULL;
 
-    if (!size_table_initialized)
-        init_size_table();
+    DPRINT("Allocating %zu bytes", size);
+    void* ptr;
+    if (size <= MAX_BLOCK_SIZE)
+        ptr = tcache_alloc(size2idx(size));
+    else if (size <= SPAN_MAX_SIZE)
+        ptr = heap_span_alloc(get_thread_heap(), size, PAGE_SIZE, false);
+    else
+        ptr = large_alloc(size, PAGE_SIZE, false);
+
+    prof_alloc(ptr, size);
+    return ptr;
+}
+
+void* malloc(size_t size) {
+    void* ptr = alloc(size);
+    trace_event(TRACE_MALLOC, ptr, size, 0);
+    return ptr;
+}
+
+// Allocate size bytes aligned to alignment, a power of two. Alignments up to a page come from size classes
+// with naturally aligned blocks where possible, larger ones from aligned spans or mappings.
+static void* aligned_malloc(size_t alignment, size_t size) {
+    void* ptr;
+    if (alignment <= MIN_BLOCK_SIZE || size == 0) {
+        ptr = alloc(size);
+    } else {
+        DPRINT("Allocating %zu bytes aligned to %zu", size, alignment);
+        int idx = alignment <= PAGE_SIZE ? size2idx_aligned(size, alignment) : -1;
+        if (idx >= 0)
+            ptr = tcache_alloc(idx);
+        else if (size <= SPAN_MAX_SIZE && alignment <= SPAN_MAX_ALIGNMENT)
+            ptr = heap_span_alloc(get_thread_heap(), size, alignment > PAGE_SIZE ? alignment : PAGE_SIZE, false);
+        else
+            ptr = large_alloc(size, alignment, false);
+
+        prof_alloc(ptr, size);
+    }
+
+    trace_event(TRACE_MEMALIGN, ptr, size, alignment);
+    return ptr;
+}
+
+static bool is_power_of_two(size_t x) {
+    return x != 0 && (x & (x - 1)) == 0;
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void*) != 0 || !is_power_of_two(alignment))
+        return EINVAL;
+
+    void* ptr = aligned_malloc(alignment, size);
+    if (ptr == NULL && size != 0)
+        return ENOMEM;
+
+    *memptr = ptr;
+    return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    if (!is_power_of_two(alignment)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return aligned_malloc(alignment, size);
+}
 
-    if (size > max_block_size)
-        return large_alloc(size);
+void* memalign(size_t alignment, size_t size) {
+    // Like glibc, round other alignments up to a power of two
+    if (!is_power_of_two(alignment)) {
+        if (alignment > SIZE_MAX / 2 + 1) {
+            errno = EINVAL;
+            return NULL;
+        }
 
-    Heap* heap = get_thread_heap();
-    DPRINT("Heap %p: allocating %zu bytes", heap, size);
-    return heap_alloc(heap, size);
+        size_t pow2 = MIN_BLOCK_SIZE;
+        while (pow2 < alignment)
+            pow2 *= 2;
+        alignment = pow2;
+    }
+
+    return aligned_malloc(alignment, size);
+}
+
+void* valloc(size_t size) {
+    return aligned_malloc(PAGE_SIZE, size);
+}
+
+void* pvalloc(size_t size) {
+    size_t rounded = (size + PAGE_SIZE - 1) & ~((size_t) PAGE_SIZE - 1);
+    if (rounded < size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return aligned_malloc(PAGE_SIZE, rounded == 0 ? PAGE_SIZE : rounded);
 }
 
 void* calloc(size_t nmemb, size_t size) {
@@ -26,51 +121,107 @@ void* calloc(size_t nmemb, size_t size) {
     if (size > (SIZE_MAX / nmemb))  // Integer overflow
         return NULL;
 
+    // Each allocator clears only the memory it does not know to be zero
     size_t num_bytes = nmemb * size;
-    void* ptr = malloc(num_bytes);
-
-    if (ptr == NULL)
-        return NULL;
+    DPRINT("Allocating %zu zeroed bytes", num_bytes);
+    void* ptr;
+    if (num_bytes <= MAX_BLOCK_SIZE)
+        ptr = tcache_calloc(size2idx(num_bytes), num_bytes);
+    else if (num_bytes <= SPAN_MAX_SIZE)
+        ptr = heap_span_alloc(get_thread_heap(), num_bytes, PAGE_SIZE, true);
+    else
+        ptr = large_alloc(num_bytes, PAGE_SIZE, true);
 
-    // Set memory to 0
-    memset(ptr, 0, num_bytes);
+    prof_alloc(ptr, num_bytes);
+    trace_event(TRACE_CALLOC, ptr, num_bytes, 0);
     return ptr;
 }
 
-void* realloc(void* ptr, size_t size) {
+// Free ptr, already classified as kind. Foreign pointers are left alone.
+static void free_kind(void* ptr, AllocKind kind) {
+    if (__builtin_expect(prof_sampled, 0))
+        prof_free(ptr, kind);
+
+    switch (kind) {
+        case ALLOC_SMALL:
+            tcache_free(ptr);
+            break;
+        case ALLOC_SPAN:
+            heap_span_free(ptr);
+            break;
+        case ALLOC_LARGE:
+            large_free(ptr);
+            break;
+        case ALLOC_FOREIGN:
+            DPRINT("Ignoring foreign pointer %p", ptr);
+            break;
+    }
+}
+
+// realloc without tracing
+static void* reallocate(void* ptr, size_t size) {
     if (ptr == NULL)
-        return NULL;
+        return alloc(size);
 
+    AllocKind kind = classify_ptr(ptr);
     if (size == 0) {
-        free(ptr);
+        free_kind(ptr, kind);
         return NULL;
     }
 
-    bool old_large = is_large_alloc(ptr);
-    bool new_large = size > max_block_size;
+    size_t old_size;
+    if (kind == ALLOC_SPAN) {
+        old_size = SPAN_TAG_PAGES(get_span_tag(ptr)) * PAGE_SIZE;
+
+        // Same span class
+        size_t new_pages;
+        if (size > MAX_BLOCK_SIZE && size <= SPAN_MAX_SIZE) {
+            get_span_class(size, &new_pages);
+            if (new_pages * PAGE_SIZE == old_size)
+                return ptr;
+        }
+    } else if (kind == ALLOC_LARGE) {
+        // Large size -> large size. The mapping may move, and its sample moves with it.
+        if (size > SPAN_MAX_SIZE) {
+            void* new_ptr = large_realloc(ptr, size);
+            if (new_ptr != NULL && __builtin_expect(prof_sampled, 0))
+                prof_realloc_large(ptr, new_ptr, size);
+            return new_ptr;
+        }
 
-    // Large size -> large size
-    if (old_large && new_large) {
-        return large_realloc(ptr, size);
+        old_size = large_alloc_size(ptr);
+    } else if (kind == ALLOC_SMALL) {
+        old_size = get_block_size(ptr);
+
+        // Same size class. Smaller classes still move, so free_sized() can find the class from the size.
+        if (size <= old_size && size2idx(size) == size2idx(old_size))
+            return ptr;
+    } else {
+        // The size of a foreign allocation is unknown, so it cannot be copied safely
+        DPRINT("Cannot reallocate foreign pointer %p", ptr);
+        return NULL;
     }
+
     // All other cases
-    void* new_ptr = malloc(size);
+    void* new_ptr = alloc(size);
     if (new_ptr == NULL) {
-        free(ptr);
+        free_kind(ptr, kind);
         return NULL;
     }
 
     // Copy memory, free old memory
-    size_t num_bytes_to_copy;
-    if (old_large)   // This means old_size > new_size
-        num_bytes_to_copy = size;
-    else { // min(old_size, new_size)
-        size_t old_size = get_block_size(ptr);
-        num_bytes_to_copy = old_size < size ? old_size : size;
-    }
-
+    size_t num_bytes_to_copy = old_size < size ? old_size : size;
     memcpy(new_ptr, ptr, num_bytes_to_copy);
-    free(ptr);
+    free_kind(ptr, kind);
+    return new_ptr;
+}
+
+void* realloc(void* ptr, size_t size) {
+    // The old block may be reused by another thread as soon as reallocate() frees it, so like free(), its
+    // release is recorded before the call
+    trace_event(TRACE_REALLOC_FREE, ptr, 0, 0);
+    void* new_ptr = reallocate(ptr, size);
+    trace_event(TRACE_REALLOC, new_ptr, size, (uintptr_t) ptr);
     return new_ptr;
 }
 
@@ -79,8 +230,73 @@ void free(void* ptr) {
     if (ptr == NULL)
         return;
 
-    if (is_large_alloc(ptr))
-        large_free(ptr);
-    else
-        heap_free(ptr);
-}
\ No newline at end of file
+    trace_event(TRACE_FREE, ptr, 0, 0);
+    free_kind(ptr, classify_ptr(ptr));
+}
+
+size_t malloc_usable_size(void* ptr) {
+    if (ptr == NULL)
+        return 0;
+
+    switch (classify_ptr(ptr)) {
+        case ALLOC_SMALL:
+            return get_block_size(ptr);
+        case ALLOC_SPAN:
+            return SPAN_TAG_PAGES(get_span_tag(ptr)) * PAGE_SIZE;
+        case ALLOC_LARGE:
+            return large_alloc_size(ptr);
+        default:
+            return 0;
+    }
+}
+
+// Classify ptr, which the size it was allocated with says is of kind expected. Confirming that takes a segment
+// map load for blocks and spans and a page map lookup for large mappings, where classify_ptr needs both for
+// the latter. Anything else, including a pointer we did not allocate, is classified in full.
+static AllocKind classify_expected(void* ptr, AllocKind expected) {
+    bool confirmed = expected == ALLOC_LARGE
+                     ? ((uintptr_t) ptr & (PAGE_SIZE - 1)) == 0 && pagemap_get(ptr) != 0
+                     : get_segment_kind(ptr) == expected;
+    return confirmed ? expected : classify_ptr(ptr);
+}
+
+// The size picks the kind of allocation before any lookup, and gives the size class of a block without
+// reading its superblock header.
+void free_sized(void* ptr, size_t size) {
+    DPRINT("Freeing %p of %zu bytes...", ptr, size);
+    if (ptr == NULL)
+        return;
+
+    trace_event(TRACE_FREE, ptr, size, 0);
+    AllocKind expected = size <= MAX_BLOCK_SIZE ? ALLOC_SMALL : size <= SPAN_MAX_SIZE ? ALLOC_SPAN : ALLOC_LARGE;
+    AllocKind kind = classify_expected(ptr, expected);
+    if (kind == ALLOC_SMALL && size <= MAX_BLOCK_SIZE) {
+        if (__builtin_expect(prof_sampled, 0))
+            prof_free(ptr, kind);
+        tcache_free_idx(ptr, size2idx(size));
+    } else {
+        free_kind(ptr, kind);
+    }
+}
+
+// Same as free_sized, with the size class aligned_malloc picked.
+void free_aligned_sized(void* ptr, size_t alignment, size_t size) {
+    if (alignment <= MIN_BLOCK_SIZE || ptr == NULL) {
+        free_sized(ptr, size);
+        return;
+    }
+
+    DPRINT("Freeing %p of %zu bytes aligned to %zu...", ptr, size, alignment);
+    trace_event(TRACE_FREE, ptr, size, 0);
+    int idx = alignment <= PAGE_SIZE ? size2idx_aligned(size, alignment) : -1;
+    AllocKind expected = idx >= 0 ? ALLOC_SMALL
+                         : size <= SPAN_MAX_SIZE && alignment <= SPAN_MAX_ALIGNMENT ? ALLOC_SPAN : ALLOC_LARGE;
+    AllocKind kind = classify_expected(ptr, expected);
+    if (kind == ALLOC_SMALL && idx >= 0) {
+        if (__builtin_expect(prof_sampled, 0))
+            prof_free(ptr, kind);
+        tcache_free_idx(ptr, idx);
+    } else {
+        free_kind(ptr, kind);
+    }
+}
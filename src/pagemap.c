@@ -0,0 +1,49 @@
+#include <sys/mman.h>
+#include "pagemap.h"
+
+uint8_t segment_map[SEGMENT_MAP_SIZE];
+size_t* pagemap_root[PAGEMAP_ROOT_SIZE];
+
+void set_segment_kind(void* segment, size_t size, AllocKind kind) {
+    uintptr_t first = (uintptr_t) segment >> LG_SEGMENT_SIZE;
+    ASSERT(first + (size >> LG_SEGMENT_SIZE) <= SEGMENT_MAP_SIZE);
+
+    for (uintptr_t i = first; i < first + (size >> LG_SEGMENT_SIZE); i++)
+        __atomic_store_n(&segment_map[i], (uint8_t) kind, __ATOMIC_RELEASE);
+}
+
+static size_t* get_leaf(uintptr_t page) {
+    size_t** slot = &pagemap_root[page >> LG_PAGEMAP_LEAF_PAGES];
+    size_t* leaf = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (leaf != NULL)
+        return leaf;
+
+    size_t leaf_size = PAGEMAP_LEAF_PAGES * sizeof(size_t);
+    leaf = mmap(NULL, leaf_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    if (leaf == MAP_FAILED) {
+        perror("mmap failed");
+        return NULL;
+    }
+
+    // Another thread may have installed a leaf for the same range first
+    size_t* expected = NULL;
+    if (!__atomic_compare_exchange_n(slot, &expected, leaf, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        munmap(leaf, leaf_size);
+        return expected;
+    }
+
+    DPRINT("      Added page map leaf %p for page %#lx", leaf, page);
+    return leaf;
+}
+
+bool pagemap_set(void* ptr, size_t size) {
+    uintptr_t page = (uintptr_t) ptr >> LG_PAGE_SIZE;
+    ASSERT(page >> LG_PAGEMAP_LEAF_PAGES < PAGEMAP_ROOT_SIZE);
+
+    size_t* leaf = get_leaf(page);
+    if (leaf == NULL)
+        return false;
+
+    leaf[page & (PAGEMAP_LEAF_PAGES - 1)] = size;
+    return true;
+}
@@ -0,0 +1,389 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <link.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "profiler.h"
+#include "span.h"
+#include "superblock.h"
+
+// Samples and the stacks they were taken at live in hash tables under one lock; sampling is rare enough
+// that it does not contend. Their nodes come from mmap'd chunks, so the profiler never calls malloc.
+// Frees take the lock only if the allocation is marked as possibly sampled (see set_sampled) and its
+// bucket in the sample table is not empty.
+
+#define LG_PROF_STACK_BUCKETS 14
+#define LG_PROF_SAMPLE_BUCKETS 16
+#define PROF_CHUNK_SIZE (1 << 20)  // Node memory is mapped this much at a time
+#define PROF_MAX_SKIPPED 4  // Frames of the allocator itself that may be on top of a stack
+
+// A distinct call stack, with the totals of the samples taken at it
+typedef struct prof_stack {
+    struct prof_stack* next;
+    uint64_t hash;
+    int depth;
+    void* frames[PROF_MAX_DEPTH];
+    size_t live_objects;
+    size_t live_bytes;
+    size_t total_objects;
+    size_t total_bytes;
+} ProfStack;
+
+// A sampled allocation that has not been freed
+typedef struct prof_sample {
+    struct prof_sample* next;
+    void* ptr;
+    size_t size;
+    ProfStack* stack;
+} ProfSample;
+
+typedef struct profiler {
+    pthread_mutex_t mutex;
+    size_t rate;  // Mean bytes between samples
+    ProfStack* stacks[1 << LG_PROF_STACK_BUCKETS];
+    ProfSample* samples[1 << LG_PROF_SAMPLE_BUCKETS];
+    ProfSample* free_samples;
+    char* chunk_cursor;  // Unused part of the last node chunk
+    char* chunk_end;
+} Profiler;
+
+static Profiler profiler = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+bool prof_enabled;
+bool prof_sampled;
+__thread long prof_bytes_left __attribute__ ((tls_model ("initial-exec")));
+
+static __thread uint64_t prof_random;  // xorshift state, seeded on the thread's first sample
+static __thread bool prof_busy;  // Set while the thread is inside the profiler, whose callees may allocate
+
+static const char* prof_dump_path;  // Where to dump at exit
+static uintptr_t prof_self_start;  // Code of this library, whose frames are left out of stacks
+static uintptr_t prof_self_end;
+
+// Draw the bytes until the next sample from an exponential distribution with mean profiler.rate.
+static long next_sample_distance() {
+    if (prof_random == 0)
+        prof_random = ((uint64_t) (uintptr_t) &prof_random ^ (uint64_t) time(NULL)) | 1;
+
+    prof_random ^= prof_random << 13;
+    prof_random ^= prof_random >> 7;
+    prof_random ^= prof_random << 17;
+
+    double uniform = ((prof_random >> 11) + 1) * 0x1.0p-53;  // In (0, 1]
+    return (long) (-log(uniform) * (double) profiler.rate) + 1;
+}
+
+// Allocate a node from the chunks. Called with the profiler locked.
+static void* prof_node_alloc(size_t size) {
+    if (profiler.chunk_cursor == NULL || profiler.chunk_cursor + size > profiler.chunk_end) {
+        char* chunk = mmap(NULL, PROF_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (chunk == MAP_FAILED)
+            return NULL;
+
+        profiler.chunk_cursor = chunk;
+        profiler.chunk_end = chunk + PROF_CHUNK_SIZE;
+    }
+
+    void* node = profiler.chunk_cursor;
+    profiler.chunk_cursor += (size + 15) & ~(size_t) 15;
+    return node;
+}
+
+static size_t sample_bucket(void* ptr) {
+    return ((uintptr_t) ptr * 11400714819323198485UL) >> (64 - LG_PROF_SAMPLE_BUCKETS);  // Knuth hash
+}
+
+// Find or add the stack of frames. Called with the profiler locked.
+static ProfStack* find_stack(void** frames, int depth) {
+    uint64_t hash = 14695981039346656037UL;  // FNV-1a
+    for (int i = 0; i < depth; i++) {
+        hash ^= (uintptr_t) frames[i];
+        hash *= 1099511628211UL;
+    }
+
+    ProfStack** bucket = &profiler.stacks[hash >> (64 - LG_PROF_STACK_BUCKETS)];
+    for (ProfStack* stack = *bucket; stack != NULL; stack = stack->next) {
+        if (stack->hash == hash && stack->depth == depth && memcmp(stack->frames, frames, depth * sizeof(void*)) == 0)
+            return stack;
+    }
+
+    ProfStack* stack = prof_node_alloc(sizeof(ProfStack));
+    if (stack == NULL)
+        return NULL;
+
+    memset(stack, 0, sizeof(ProfStack));
+    stack->hash = hash;
+    stack->depth = depth;
+    memcpy(stack->frames, frames, depth * sizeof(void*));
+    stack->next = *bucket;
+    *bucket = stack;
+    return stack;
+}
+
+// Mark the allocation at ptr as sampled or not, where free can see it cheaply.
+static void set_sampled(void* ptr, AllocKind kind, bool sampled) {
+    if (kind == ALLOC_SMALL) {
+        unsigned int* count = &GET_SUPERBLOCK(ptr)->header.sampled_blocks;
+        if (sampled)
+            __atomic_add_fetch(count, 1, __ATOMIC_RELAXED);
+        else
+            __atomic_sub_fetch(count, 1, __ATOMIC_RELAXED);
+    } else if (kind == ALLOC_SPAN) {
+        set_span_sampled(ptr, sampled);
+    }
+}
+
+void prof_sample(void* ptr, size_t size) {
+    if (prof_busy)
+        return;
+
+    // A thread's first allocations only start its countdown
+    bool first = prof_random == 0;
+    prof_busy = true;
+    prof_bytes_left = next_sample_distance();
+    if (first) {
+        prof_busy = false;
+        return;
+    }
+
+    // How many frames the allocator has depends on inlining, so skip all of them
+    void* frames[PROF_MAX_DEPTH + PROF_MAX_SKIPPED];
+    int depth = backtrace(frames, PROF_MAX_DEPTH + PROF_MAX_SKIPPED);
+    int skipped = 0;
+    while (skipped < depth && skipped < PROF_MAX_SKIPPED && (uintptr_t) frames[skipped] >= prof_self_start
+           && (uintptr_t) frames[skipped] < prof_self_end)
+        skipped++;
+
+    depth -= skipped;
+    if (depth > PROF_MAX_DEPTH)
+        depth = PROF_MAX_DEPTH;
+
+    pthread_mutex_lock(&profiler.mutex);
+    ProfStack* stack = find_stack(frames + skipped, depth);
+    ProfSample* sample = profiler.free_samples;
+    if (sample != NULL)
+        profiler.free_samples = sample->next;
+    else
+        sample = prof_node_alloc(sizeof(ProfSample));
+
+    if (stack != NULL && sample != NULL) {
+        stack->live_objects++;
+        stack->live_bytes += size;
+        stack->total_objects++;
+        stack->total_bytes += size;
+
+        ProfSample** bucket = &profiler.samples[sample_bucket(ptr)];
+        sample->ptr = ptr;
+        sample->size = size;
+        sample->stack = stack;
+        sample->next = *bucket;
+        __atomic_store_n(bucket, sample, __ATOMIC_RELAXED);
+
+        set_sampled(ptr, classify_ptr(ptr), true);
+        __atomic_store_n(&prof_sampled, true, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&profiler.mutex);
+    prof_busy = false;
+}
+
+void prof_free(void* ptr, AllocKind kind) {
+    // Only look up pointers that may have a sample
+    switch (kind) {
+        case ALLOC_SMALL:
+            if (__atomic_load_n(&GET_SUPERBLOCK(ptr)->header.sampled_blocks, __ATOMIC_RELAXED) == 0)
+                return;
+            break;
+        case ALLOC_SPAN:
+            if (!(get_span_tag(ptr) & SPAN_SAMPLED))
+                return;
+            break;
+        case ALLOC_LARGE:
+            break;
+        case ALLOC_FOREIGN:
+            return;
+    }
+
+    // Only the free of ptr removes its sample, so the bucket cannot be empty if it has one
+    ProfSample** link = &profiler.samples[sample_bucket(ptr)];
+    if (__atomic_load_n(link, __ATOMIC_RELAXED) == NULL)
+        return;
+
+    pthread_mutex_lock(&profiler.mutex);
+    while (*link != NULL && (*link)->ptr != ptr)
+        link = &(*link)->next;
+
+    ProfSample* sample = *link;
+    if (sample != NULL) {
+        __atomic_store_n(link, sample->next, __ATOMIC_RELAXED);
+        sample->stack->live_objects--;
+        sample->stack->live_bytes -= sample->size;
+        sample->next = profiler.free_samples;
+        profiler.free_samples = sample;
+        set_sampled(ptr, kind, false);
+    }
+    pthread_mutex_unlock(&profiler.mutex);
+}
+
+void prof_realloc_large(void* old_ptr, void* new_ptr, size_t size) {
+    ProfSample** link = &profiler.samples[sample_bucket(old_ptr)];
+    if (__atomic_load_n(link, __ATOMIC_RELAXED) == NULL)
+        return;
+
+    pthread_mutex_lock(&profiler.mutex);
+    while (*link != NULL && (*link)->ptr != old_ptr)
+        link = &(*link)->next;
+
+    // The allocation keeps its stack and place in the totals, at its new size
+    ProfSample* sample = *link;
+    if (sample != NULL) {
+        __atomic_store_n(link, sample->next, __ATOMIC_RELAXED);
+        sample->stack->live_bytes += size - sample->size;
+        sample->ptr = new_ptr;
+        sample->size = size;
+
+        ProfSample** bucket = &profiler.samples[sample_bucket(new_ptr)];
+        sample->next = *bucket;
+        __atomic_store_n(bucket, sample, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&profiler.mutex);
+}
+
+// Find the executable segment of the object containing prof_sample.
+static int find_self(struct dl_phdr_info* info, size_t size, void* data) {
+    (void) size;
+    (void) data;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X))
+            continue;
+
+        uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+        uintptr_t end = start + phdr->p_memsz;
+        if ((uintptr_t) prof_sample >= start && (uintptr_t) prof_sample < end) {
+            prof_self_start = start;
+            prof_self_end = end;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void mymalloc_prof_enable(size_t rate) {
+    pthread_mutex_lock(&profiler.mutex);
+    if (rate > 0)
+        profiler.rate = rate;
+    pthread_mutex_unlock(&profiler.mutex);
+
+    // Load the unwinder now rather than in the middle of the first sample
+    if (rate > 0) {
+        void* frame;
+        backtrace(&frame, 1);
+        dl_iterate_phdr(find_self, NULL);
+    }
+
+    __atomic_store_n(&prof_enabled, rate > 0, __ATOMIC_RELAXED);
+}
+
+// Write a formatted line to fd. Returns false on failure.
+__attribute__ ((format (printf, 2, 3)))
+static bool write_line(int fd, const char* format, ...) {
+    char line[64 + PROF_MAX_DEPTH * 20];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if (len < 0)
+        return false;
+    if ((size_t) len >= sizeof(line))
+        len = sizeof(line) - 1;
+    return write(fd, line, len) == len;
+}
+
+// Write the frames of a stack after its counts, in the format pprof reads.
+static bool write_stack(int fd, ProfStack* stack) {
+    char line[64 + PROF_MAX_DEPTH * 20];
+    int len = snprintf(line, sizeof(line), "%6zu: %8zu [%6zu: %8zu] @", stack->live_objects, stack->live_bytes,
+                       stack->total_objects, stack->total_bytes);
+    for (int i = 0; i < stack->depth; i++)
+        len += snprintf(line + len, sizeof(line) - len, " %p", stack->frames[i]);
+    line[len++] = '\n';
+    return write(fd, line, len) == len;
+}
+
+// Append /proc/self/maps, which pprof needs to symbolize the addresses.
+static bool write_maps(int fd) {
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps == -1)
+        return false;
+
+    char buffer[4096];
+    ssize_t len;
+    bool ok = true;
+    while (ok && (len = read(maps, buffer, sizeof(buffer))) > 0)
+        ok = write(fd, buffer, len) == len;
+
+    close(maps);
+    return ok;
+}
+
+int mymalloc_prof_dump(const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return errno;
+
+    prof_busy = true;
+    pthread_mutex_lock(&profiler.mutex);
+
+    // Totals first
+    size_t live_objects = 0, live_bytes = 0, total_objects = 0, total_bytes = 0;
+    for (size_t b = 0; b < (1 << LG_PROF_STACK_BUCKETS); b++) {
+        for (ProfStack* stack = profiler.stacks[b]; stack != NULL; stack = stack->next) {
+            live_objects += stack->live_objects;
+            live_bytes += stack->live_bytes;
+            total_objects += stack->total_objects;
+            total_bytes += stack->total_bytes;
+        }
+    }
+
+    bool ok = write_line(fd, "heap profile: %6zu: %8zu [%6zu: %8zu] @ heap_v2/%zu\n",
+                         live_objects, live_bytes, total_objects, total_bytes, profiler.rate);
+    for (size_t b = 0; ok && b < (1 << LG_PROF_STACK_BUCKETS); b++) {
+        for (ProfStack* stack = profiler.stacks[b]; ok && stack != NULL; stack = stack->next)
+            ok = write_stack(fd, stack);
+    }
+
+    pthread_mutex_unlock(&profiler.mutex);
+    ok = ok && write_line(fd, "\nMAPPED_LIBRARIES:\n") && write_maps(fd);
+    prof_busy = false;
+
+    int err = ok ? 0 : errno;
+    if (close(fd) == -1 && err == 0)
+        err = errno;
+    return err;
+}
+
+__attribute__ ((destructor))
+static void prof_dump_at_exit() {
+    if (prof_dump_path != NULL && mymalloc_prof_dump(prof_dump_path) != 0)
+        perror("mymalloc: heap profile dump failed");
+}
+
+__attribute__ ((constructor))
+static void init_profiler() {
+    const char* env = getenv("MYMALLOC_PROF_RATE");
+    if (env != NULL && atol(env) > 0)
+        mymalloc_prof_enable(atol(env));
+
+    prof_dump_path = getenv("MYMALLOC_PROF_DUMP");
+}
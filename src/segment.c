@@ -0,0 +1,77 @@
+#include <sys/mman.h>
+#include <stdint.h>
+#include "segment.h"
+
+// Bytes of all segments reserved so far
+static size_t reserved_bytes;
+
+// Record a new segment and ask for transparent huge pages, if enabled.
+static char* init_segment(char* segment, size_t size, AllocKind kind) {
+#ifdef HUGEPAGE_SEGMENTS
+    if (madvise(segment, size, MADV_HUGEPAGE) == -1)
+        perror("madvise failed");
+#endif
+    set_segment_kind(segment, size, kind);
+    __atomic_add_fetch(&reserved_bytes, size, __ATOMIC_RELAXED);
+    return segment;
+}
+
+size_t segment_reserved_bytes() {
+    return __atomic_load_n(&reserved_bytes, __ATOMIC_RELAXED);
+}
+
+char* reserve_segment(size_t size, char* hint, AllocKind kind) {
+    int flags = MAP_PRIVATE | MAP_ANON | MAP_NORESERVE;
+
+    // Extend the previous segment if the address range after it is free
+    if (hint != NULL) {
+        char* ptr = mmap(hint, size, PROT_READ | PROT_WRITE, flags | MAP_FIXED_NOREPLACE, -1, 0);
+        if (ptr == hint) {
+            DPRINT("      Extended segment at %p by %zu bytes", hint, size);
+            return init_segment(ptr, size, kind);
+        }
+
+        // Kernels before 4.17 treat the address as a plain hint
+        if (ptr != MAP_FAILED)
+            munmap(ptr, size);
+    }
+
+    // Allocate size + SEGMENT_SIZE bytes and trim to alignment
+    char* ptr = mmap(NULL, size + SEGMENT_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (ptr == MAP_FAILED) {
+        perror("mmap failed");
+        return NULL;
+    }
+
+    uintptr_t alignment = (uintptr_t) ptr & (SEGMENT_SIZE - 1);
+    uintptr_t prologue_bytes = alignment == 0 ? 0 : SEGMENT_SIZE - alignment;
+    char* aligned_ptr = ptr + prologue_bytes;
+
+    // Unmap prologue and epilogue
+    if (prologue_bytes > 0)
+        munmap(ptr, prologue_bytes);
+    munmap(aligned_ptr + size, SEGMENT_SIZE - prologue_bytes);
+
+    DPRINT("      Reserved segment at %p of %zu bytes", aligned_ptr, size);
+    return init_segment(aligned_ptr, size, kind);
+}
+
+void* arena_alloc(SegmentArena* arena, size_t size) {
+    pthread_mutex_lock(&arena->mutex);
+
+    char* ptr = (char*) (((uintptr_t) arena->cursor + size - 1) & ~(uintptr_t) (size - 1));
+    if (arena->cursor == NULL || ptr + size > arena->end) {
+        char* segment = reserve_segment(SEGMENT_SIZE, arena->end, arena->kind);
+        if (segment == NULL) {
+            pthread_mutex_unlock(&arena->mutex);
+            return NULL;
+        }
+
+        arena->end = segment + SEGMENT_SIZE;
+        ptr = segment;
+    }
+
+    arena->cursor = ptr + size;
+    pthread_mutex_unlock(&arena->mutex);
+    return ptr;
+}
@@ -0,0 +1,205 @@
+#include <pthread.h>
+#include <sys/mman.h>
+#include "decay.h"
+#include "segment.h"
+#include "span.h"
+
+// Free spans shared by all heaps
+typedef struct span_pool {
+    pthread_mutex_t mutex;
+    SpanNode* bins[NUM_SPAN_BINS];  // Free spans by page class, rounded down
+    uint64_t nonempty_bins;  // Bit i is set when bins[i] is not empty
+    char* segments_end;  // End of the last span segment, where the next one goes if possible
+    unsigned long next_purge_ms;
+} SpanPool;
+
+_Static_assert(NUM_SPAN_BINS <= 64, "Span bins must fit in nonempty_bins");
+
+static SpanPool span_pool = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static size_t page_index(SpanSegment* segment, void* ptr) {
+    return ((char*) ptr - (char*) segment) >> LG_PAGE_SIZE;
+}
+
+static void set_span_tags(void* ptr, size_t pages, uint32_t tag) {
+    SpanSegment* segment = get_span_segment(ptr);
+    size_t first = page_index(segment, ptr);
+    segment->tags[first] = tag;
+    segment->tags[first + pages - 1] = tag;
+}
+
+void set_span_sampled(void* ptr, bool sampled) {
+    SpanSegment* segment = get_span_segment(ptr);
+    size_t first = page_index(segment, ptr);
+    size_t last = first + SPAN_TAG_PAGES(segment->tags[first]) - 1;
+
+    // Free neighbours read the last tag without the owner's lock
+    if (sampled) {
+        __atomic_fetch_or(&segment->tags[first], SPAN_SAMPLED, __ATOMIC_RELAXED);
+        __atomic_fetch_or(&segment->tags[last], SPAN_SAMPLED, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(&segment->tags[first], ~SPAN_SAMPLED, __ATOMIC_RELAXED);
+        __atomic_fetch_and(&segment->tags[last], ~SPAN_SAMPLED, __ATOMIC_RELAXED);
+    }
+}
+
+// Page class of a free span, rounded down so every span in a bin fits any request of that class
+static int free_span_bin(size_t pages) {
+    size_t rounded;
+    int bin = page_class(pages, &rounded);
+    return rounded == pages ? bin : bin - 1;
+}
+
+static void insert_free_span(void* ptr, size_t pages, bool purged, unsigned long freed_ms) {
+    SpanNode* span = ptr;
+    int bin = free_span_bin(pages);
+
+    span->pages = pages;
+    span->purged = purged;
+    span->freed_ms = freed_ms;
+    span->prev = NULL;
+    span->next = span_pool.bins[bin];
+    if (span->next != NULL)
+        span->next->prev = span;
+
+    span_pool.bins[bin] = span;
+    span_pool.nonempty_bins |= (uint64_t) 1 << bin;
+    set_span_tags(span, pages, SPAN_TAG(pages, 0) | SPAN_FREE);
+}
+
+static void remove_free_span(SpanNode* span) {
+    int bin = free_span_bin(span->pages);
+
+    if (span->prev != NULL)
+        span->prev->next = span->next;
+    else
+        span_pool.bins[bin] = span->next;
+
+    if (span->next != NULL)
+        span->next->prev = span->prev;
+
+    if (span_pool.bins[bin] == NULL)
+        span_pool.nonempty_bins &= ~((uint64_t) 1 << bin);
+}
+
+// Reserve a new span segment, all of it one free span. Called with the pool locked.
+static bool add_span_segment() {
+    char* ptr = reserve_segment(SEGMENT_SIZE, span_pool.segments_end, ALLOC_SPAN);
+    if (ptr == NULL)
+        return false;
+
+    SpanSegment* segment = (SpanSegment*) ptr;
+    segment->magic = SPAN_SEGMENT_MAGIC;
+    span_pool.segments_end = ptr + SEGMENT_SIZE;
+
+    DPRINT("    Added span segment %p", segment);
+    insert_free_span(ptr + SPAN_HEADER_PAGES * PAGE_SIZE, SEGMENT_PAGES - SPAN_HEADER_PAGES, true, now_ms());
+    return true;
+}
+
+static void purge_span_pool_locked(unsigned long now) {
+    span_pool.next_purge_ms = now + (decay_ms / 4 > PURGE_INTERVAL_MIN_MS ? decay_ms / 4 : PURGE_INTERVAL_MIN_MS);
+
+    for (int bin = 0; bin < NUM_SPAN_BINS; bin++) {
+        for (SpanNode* span = span_pool.bins[bin]; span != NULL; span = span->next) {
+            if (span->purged || now - span->freed_ms < (unsigned long) decay_ms)
+                continue;
+
+            // Keep the first page, which holds the node
+            if (madvise((char*) span + PAGE_SIZE, (span->pages - 1) * PAGE_SIZE, PURGE_ADVICE) == -1)
+                perror("madvise failed");
+            span->purged = true;
+        }
+    }
+}
+
+// Purge the pool if a purge pass is due. Called with the pool locked.
+static void maybe_purge_span_pool() {
+    if (decay_ms < 0)
+        return;
+
+    unsigned long now = now_ms();
+    if (now >= span_pool.next_purge_ms)
+        purge_span_pool_locked(now);
+}
+
+void purge_span_pool() {
+    if (decay_ms < 0)
+        return;
+
+    pthread_mutex_lock(&span_pool.mutex);
+    purge_span_pool_locked(now_ms());
+    pthread_mutex_unlock(&span_pool.mutex);
+}
+
+void* span_pool_alloc(size_t pages, size_t alignment, int owner, size_t* dirty_bytes) {
+    // Enough pages to find an aligned start in any span of these bins
+    size_t needed = pages + (alignment >> LG_PAGE_SIZE) - 1;
+    int span_class = page_class(needed, &needed);
+    uint64_t mask = ~(uint64_t) 0 << span_class;
+
+    pthread_mutex_lock(&span_pool.mutex);
+    if ((span_pool.nonempty_bins & mask) == 0 && !add_span_segment()) {
+        pthread_mutex_unlock(&span_pool.mutex);
+        return NULL;
+    }
+
+    // Take the first span of the smallest bin that fits and give back the rest
+    SpanNode* free_span = span_pool.bins[__builtin_ctzll(span_pool.nonempty_bins & mask)];
+    ASSERT(free_span->pages >= needed);
+    remove_free_span(free_span);
+
+    size_t free_pages = free_span->pages;
+    bool purged = free_span->purged;
+    unsigned long freed_ms = free_span->freed_ms;
+    char* span = (char*) (((uintptr_t) free_span + alignment - 1) & ~(uintptr_t) (alignment - 1));
+    size_t lead_pages = (span - (char*) free_span) >> LG_PAGE_SIZE;
+
+    if (lead_pages > 0)
+        insert_free_span(free_span, lead_pages, purged, freed_ms);
+    if (free_pages > lead_pages + pages)
+        insert_free_span(span + pages * PAGE_SIZE, free_pages - lead_pages - pages, purged, freed_ms);
+
+    // A purged span was cleared past its first page, which holds the node. New segments count as purged.
+    if (!purged || !PURGE_ZEROES)
+        *dirty_bytes = pages * PAGE_SIZE;
+    else
+        *dirty_bytes = lead_pages == 0 ? PAGE_SIZE : 0;
+
+    set_span_tags(span, pages, SPAN_TAG(pages, owner));
+    maybe_purge_span_pool();
+    pthread_mutex_unlock(&span_pool.mutex);
+
+    DPRINT("    Allocated span %p of %zu pages", span, pages);
+    return span;
+}
+
+void span_pool_free(void* ptr, size_t pages) {
+    SpanSegment* segment = get_span_segment(ptr);
+    ASSERT(segment->magic == SPAN_SEGMENT_MAGIC);
+    size_t first = page_index(segment, ptr);
+
+    pthread_mutex_lock(&span_pool.mutex);
+
+    // Merge with the span ending right before this one
+    if (first > SPAN_HEADER_PAGES && (segment->tags[first - 1] & SPAN_FREE)) {
+        size_t left_pages = SPAN_TAG_PAGES(segment->tags[first - 1]);
+        first -= left_pages;
+        pages += left_pages;
+        remove_free_span((SpanNode*) ((char*) segment + first * PAGE_SIZE));
+    }
+
+    // Merge with the span starting right after this one
+    if (first + pages < SEGMENT_PAGES) {
+        uint32_t tag = segment->tags[first + pages];
+        if (tag & SPAN_FREE) {
+            remove_free_span((SpanNode*) ((char*) segment + (first + pages) * PAGE_SIZE));
+            pages += SPAN_TAG_PAGES(tag);
+        }
+    }
+
+    DPRINT("    Freed span %p, now part of %zu free pages", ptr, pages);
+    insert_free_span((char*) segment + first * PAGE_SIZE, pages, false, now_ms());
+    maybe_purge_span_pool();
+    pthread_mutex_unlock(&span_pool.mutex);
+}
@@ -0,0 +1,250 @@
+#include <errno.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "binmanager.h"
+#include "heap.h"
+#include "largealloc.h"
+#include "segment.h"
+#include "stats.h"
+
+// Statistics by name for mymalloc_stat
+typedef struct stat_field {
+    const char* name;
+    size_t offset;
+} StatField;
+
+#define HEAP_FIELD(field) { #field, offsetof(HeapStats, field) }
+#define CLASS_FIELD(field) { #field, offsetof(ClassStats, field) }
+#define LARGE_FIELD(field) { #field, offsetof(LargeStats, field) }
+
+static const StatField heap_fields[] = {
+    HEAP_FIELD(in_use), HEAP_FIELD(alloced), HEAP_FIELD(max_in_use), HEAP_FIELD(max_alloced),
+    HEAP_FIELD(superblocks), HEAP_FIELD(recycled_superblocks), HEAP_FIELD(sb_from_global),
+    HEAP_FIELD(sb_to_global), HEAP_FIELD(span_in_use), HEAP_FIELD(span_cached), HEAP_FIELD(span_allocs),
+    HEAP_FIELD(span_frees),
+};
+
+static const StatField class_fields[] = {
+    CLASS_FIELD(superblocks), CLASS_FIELD(live_blocks), CLASS_FIELD(allocs), CLASS_FIELD(frees),
+};
+
+static const StatField large_fields[] = {
+    LARGE_FIELD(in_use), LARGE_FIELD(cached), LARGE_FIELD(allocs), LARGE_FIELD(frees),
+};
+
+#define NUM_FIELDS(fields) (sizeof(fields) / sizeof((fields)[0]))
+
+static void add_class_stats(ClassStats* sum, const ClassStats* stats) {
+    sum->superblocks += stats->superblocks;
+    sum->live_blocks += stats->live_blocks;
+    sum->allocs += stats->allocs;
+    sum->frees += stats->frees;
+}
+
+void add_heap_stats(HeapStats* sum, const HeapStats* stats) {
+    sum->in_use += stats->in_use;
+    sum->alloced += stats->alloced;
+    sum->max_in_use += stats->max_in_use;
+    sum->max_alloced += stats->max_alloced;
+    sum->superblocks += stats->superblocks;
+    sum->recycled_superblocks += stats->recycled_superblocks;
+    sum->sb_from_global += stats->sb_from_global;
+    sum->sb_to_global += stats->sb_to_global;
+    sum->span_in_use += stats->span_in_use;
+    sum->span_cached += stats->span_cached;
+    sum->span_allocs += stats->span_allocs;
+    sum->span_frees += stats->span_frees;
+
+    for (int b = 0; b < NUM_SIZE_BINS; b++)
+        add_class_stats(&sum->classes[b], &stats->classes[b]);
+}
+
+void get_malloc_totals(MallocTotals* totals) {
+    memset(totals, 0, sizeof(MallocTotals));
+
+    HeapStats stats;
+    for (int i = 0; i < MAX_HEAPS; i++) {
+        heap_get_stats(&thread_heaps[i], &stats);
+        add_heap_stats(&totals->heaps, &stats);
+    }
+
+    heap_get_stats(&global_heap, &totals->global);
+    get_large_stats(&totals->large);
+    totals->segments = segment_reserved_bytes();
+}
+
+// Bytes of blocks handed out, in the thread heaps and the global heap
+static size_t live_block_bytes(const MallocTotals* totals) {
+    size_t bytes = 0;
+    for (int b = 0; b < NUM_SIZE_BINS; b++) {
+        size_t live_blocks = totals->heaps.classes[b].live_blocks + totals->global.classes[b].live_blocks;
+        bytes += live_blocks * idx2class(b);
+    }
+    return bytes;
+}
+
+size_t totals_allocated(const MallocTotals* totals) {
+    return live_block_bytes(totals) + totals->heaps.span_in_use + totals->large.in_use;
+}
+
+size_t totals_owned(const MallocTotals* totals) {
+    size_t superblocks = totals->heaps.superblocks + totals->global.superblocks;
+    return superblocks * SUPERBLOCK_SIZE + totals->heaps.span_in_use + totals->heaps.span_cached +
+           totals->large.in_use + totals->large.cached;
+}
+
+size_t totals_mapped(const MallocTotals* totals) {
+    return totals->segments + totals->large.in_use + totals->large.cached;
+}
+
+struct mallinfo2 mallinfo2() {
+    MallocTotals totals;
+    get_malloc_totals(&totals);
+
+    // Superblocks and spans play the part of the arena, large allocations that of mmapped chunks
+    struct mallinfo2 info = { 0 };
+    size_t superblocks = totals.heaps.superblocks + totals.global.superblocks;
+    info.arena = superblocks * SUPERBLOCK_SIZE + totals.heaps.span_in_use + totals.heaps.span_cached;
+    info.ordblks = totals.heaps.recycled_superblocks + totals.global.recycled_superblocks;
+    info.hblks = totals.large.allocs - totals.large.frees;
+    info.hblkhd = totals.large.in_use;
+    info.uordblks = live_block_bytes(&totals) + totals.heaps.span_in_use;
+    info.fordblks = info.arena - info.uordblks;
+    info.keepcost = totals.heaps.span_cached + totals.large.cached;
+    return info;
+}
+
+void malloc_stats() {
+    HeapStats stats;
+    for (int i = 0; i <= MAX_HEAPS; i++) {
+        heap_get_stats(i < MAX_HEAPS ? &thread_heaps[i] : &global_heap, &stats);
+        if (stats.superblocks == 0 && stats.span_in_use == 0 && stats.span_cached == 0)
+            continue;
+
+        if (i < MAX_HEAPS)
+            fprintf(stderr, "Heap %d:\n", i);
+        else
+            fprintf(stderr, "Global heap:\n");
+        fprintf(stderr, "  superblocks     = %zu (%zu recycled, %zu from global, %zu to global)\n",
+                stats.superblocks, stats.recycled_superblocks, stats.sb_from_global, stats.sb_to_global);
+        fprintf(stderr, "  in use bytes    = %zu (max %zu)\n", stats.in_use, stats.max_in_use);
+        fprintf(stderr, "  span bytes      = %zu (%zu cached)\n", stats.span_in_use, stats.span_cached);
+    }
+
+    MallocTotals totals;
+    get_malloc_totals(&totals);
+
+    fprintf(stderr, "Size classes:\n");
+    fprintf(stderr, "  %10s %12s %12s %14s %14s\n", "size", "superblocks", "live blocks", "allocs", "frees");
+    for (int b = 0; b < NUM_SIZE_BINS; b++) {
+        ClassStats sum = { 0 };
+        add_class_stats(&sum, &totals.heaps.classes[b]);
+        add_class_stats(&sum, &totals.global.classes[b]);
+        if (sum.superblocks == 0 && sum.allocs == 0)
+            continue;
+
+        fprintf(stderr, "  %10zu %12zu %12zu %14zu %14zu\n",
+                idx2class(b), sum.superblocks, sum.live_blocks, sum.allocs, sum.frees);
+    }
+
+    fprintf(stderr, "Spans:\n");
+    fprintf(stderr, "  in use bytes    = %zu (%zu allocs, %zu frees)\n",
+            totals.heaps.span_in_use, totals.heaps.span_allocs, totals.heaps.span_frees);
+    fprintf(stderr, "Large allocations:\n");
+    fprintf(stderr, "  in use bytes    = %zu (%zu allocs, %zu frees)\n",
+            totals.large.in_use, totals.large.allocs, totals.large.frees);
+    fprintf(stderr, "  cached bytes    = %zu\n", totals.large.cached);
+    fprintf(stderr, "Total:\n");
+    fprintf(stderr, "  reserved bytes  = %zu\n", totals.segments);
+    fprintf(stderr, "  mapped bytes    = %zu\n", totals_mapped(&totals));
+}
+
+// Look up name among fields, reading it from the struct at base.
+static int read_field(const StatField* fields, size_t num_fields, const void* base, const char* name,
+                      size_t* value) {
+    for (size_t i = 0; i < num_fields; i++) {
+        if (strcmp(fields[i].name, name) == 0) {
+            *value = *(const size_t*) ((const char*) base + fields[i].offset);
+            return 0;
+        }
+    }
+    return ENOENT;
+}
+
+// Parse "<index>.<rest>", with index below limit. Returns rest, or NULL if name does not match.
+static const char* parse_index(const char* name, int limit, int* index) {
+    char* end;
+    long i = strtol(name, &end, 10);
+    if (end == name || *end != '.' || i < 0 || i >= limit)
+        return NULL;
+
+    *index = (int) i;
+    return end + 1;
+}
+
+int mymalloc_stat(const char* name, size_t* value) {
+    const char* rest;
+    int index;
+
+    if (strncmp(name, "heap.", 5) == 0) {
+        if ((rest = parse_index(name + 5, MAX_HEAPS, &index)) == NULL)
+            return ENOENT;
+
+        HeapStats stats;
+        heap_get_stats(&thread_heaps[index], &stats);
+        return read_field(heap_fields, NUM_FIELDS(heap_fields), &stats, rest, value);
+    }
+
+    if (strncmp(name, "global.", 7) == 0) {
+        HeapStats stats;
+        heap_get_stats(&global_heap, &stats);
+        return read_field(heap_fields, NUM_FIELDS(heap_fields), &stats, name + 7, value);
+    }
+
+    if (strncmp(name, "large.", 6) == 0) {
+        LargeStats stats;
+        get_large_stats(&stats);
+        return read_field(large_fields, NUM_FIELDS(large_fields), &stats, name + 6, value);
+    }
+
+    if (strcmp(name, "segments.reserved") == 0) {
+        *value = segment_reserved_bytes();
+        return 0;
+    }
+
+    // The rest need every heap
+    MallocTotals totals;
+    get_malloc_totals(&totals);
+
+    if (strncmp(name, "heaps.", 6) == 0)
+        return read_field(heap_fields, NUM_FIELDS(heap_fields), &totals.heaps, name + 6, value);
+
+    if (strncmp(name, "class.", 6) == 0) {
+        if ((rest = parse_index(name + 6, NUM_SIZE_BINS, &index)) == NULL)
+            return ENOENT;
+
+        if (strcmp(rest, "size") == 0) {
+            *value = idx2class(index);
+            return 0;
+        }
+
+        ClassStats sum = { 0 };
+        add_class_stats(&sum, &totals.heaps.classes[index]);
+        add_class_stats(&sum, &totals.global.classes[index]);
+        return read_field(class_fields, NUM_FIELDS(class_fields), &sum, rest, value);
+    }
+
+    if (strcmp(name, "mapped") == 0) {
+        *value = totals_mapped(&totals);
+        return 0;
+    }
+
+    if (strcmp(name, "allocated") == 0) {
+        *value = totals_allocated(&totals);
+        return 0;
+    }
+
+    return ENOENT;
+}
@@ -1,71 +1,56 @@
 #include <sys/mman.h>
 #include <stdint.h>
-#include <pthread.h>
 #include "superblock.h"
+#include "segment.h"
 
-static Superblock* allocate_new_superblock() {
-    // Allocate 2S bytes
-    char *ptr = (char *) mmap(NULL, 2 * SUPERBLOCK_SIZE, PROT_READ | PROT_WRITE,
-                              MAP_PRIVATE | MAP_ANON, -1, 0);
-    if (ptr == MAP_FAILED) {
-        perror("mmap failed");
-        return NULL;
-    }
+// Superblocks are carved out of shared segments
+static SegmentArena superblock_arena = SEGMENT_ARENA_INITIALIZER(ALLOC_SMALL);
 
-    // Find alignment position
-    char *aligned_ptr;
-    uintptr_t alignment = (uintptr_t) ptr & (SUPERBLOCK_SIZE - 1);
-    uintptr_t prologue_bytes;
+static Superblock* allocate_new_superblock(SuperblockChunk* chunk) {
+    if (chunk->cursor == chunk->end) {
+        char* ptr = arena_alloc(&superblock_arena, SUPERBLOCK_CHUNK_SIZE);
+        if (ptr == NULL)
+            return NULL;
 
-    if (alignment == 0) {
-        prologue_bytes = 0;
-        aligned_ptr = ptr;
-    } else {
-        prologue_bytes = SUPERBLOCK_SIZE - alignment;
-        aligned_ptr = ptr + prologue_bytes;
+        chunk->cursor = ptr;
+        chunk->end = ptr + SUPERBLOCK_CHUNK_SIZE;
     }
 
-    // Unmap prologue and epilogue
-    if (prologue_bytes > 0)
-        munmap(ptr, prologue_bytes);
-    munmap(aligned_ptr + SUPERBLOCK_SIZE, SUPERBLOCK_SIZE - prologue_bytes);
-
-    return (Superblock *) aligned_ptr;
+    Superblock* superblock = (Superblock*) chunk->cursor;
+    chunk->cursor += SUPERBLOCK_SIZE;
+    return superblock;
 }
 
-Superblock* init_superblock(size_t block_size) {
-    Superblock* superblock = allocate_new_superblock();
+Superblock* init_superblock(SuperblockChunk* chunk, size_t block_size) {
+    Superblock* superblock = allocate_new_superblock(chunk);
     if (superblock == NULL)
         return superblock;
 
-    pthread_mutex_init(&superblock->header.mutex, NULL);
     superblock->header.magic = HEADER_MAGIC;
+    superblock->header.zero_start = superblock->header.reap_position = (char*) superblock;
 
     reset_superblock(superblock, block_size);
     DPRINT("      Allocated new superblock at %p with block size = %zu", superblock, block_size);
     return superblock;
 }
 
-void lock_superblock(Superblock* superblock) {
-    DPRINT("      Locking superblock %p...", superblock);
-    ASSERT(superblock->header.magic == HEADER_MAGIC);
-    pthread_mutex_lock(&superblock->header.mutex);
-}
-
-void unlock_superblock(Superblock* superblock) {
-    DPRINT("      Unlocking superblock %p...", superblock);
-    pthread_mutex_unlock(&superblock->header.mutex);
-}
-
 void reset_superblock(Superblock* superblock, size_t block_size) {
     SuperblockHeader* header = &superblock->header;
+    size_t offset = buffer_offset(block_size);
     header->block_size = block_size;
-    header->total_blocks = (SUPERBLOCK_SIZE - sizeof(SuperblockHeader)) / block_size;
+    header->total_blocks = (SUPERBLOCK_SIZE - offset) / block_size;
+
+    // Blocks were never reaped past the old reap position, and purging cleared all but the header page
+    if (header->zero_start < header->reap_position)
+        header->zero_start = header->reap_position;
+    if (header->purged && PURGE_ZEROES && header->zero_start > (char*) superblock + PAGE_SIZE)
+        header->zero_start = (char*) superblock + PAGE_SIZE;
 
     header->prev = header->next = NULL;
+    header->purged = false;
     header->reapable_blocks = header->num_free_blocks = header->total_blocks;
     header->free_list = NULL;
-    header->reap_position = header->buffer_start = (char*) superblock + sizeof(SuperblockHeader);
+    header->reap_position = header->buffer_start = (char*) superblock + offset;
 }
 
 void* superblock_alloc(Superblock* superblock) {
@@ -109,6 +94,17 @@ bool is_superblock_empty(Superblock* superblock) {
     return header->num_free_blocks == header->total_blocks;
 }
 
+void purge_superblock(Superblock* superblock) {
+    ASSERT(is_superblock_empty(superblock));
+
+    // The header lives in the first page
+    if (madvise((char*) superblock + PAGE_SIZE, SUPERBLOCK_SIZE - PAGE_SIZE, PURGE_ADVICE) == -1)
+        perror("madvise failed");
+
+    superblock->header.purged = true;
+    DPRINT("      Purged superblock %p", superblock);
+}
+
 int used_bytes(Superblock* superblock) {
     SuperblockHeader* header = &(superblock->header);
     int used_blocks = header->total_blocks - header->num_free_blocks;
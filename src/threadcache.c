@@ -0,0 +1,138 @@
+#include <pthread.h>
+#include <string.h>
+#include "threadcache.h"
+#include "binmanager.h"
+#include "heap.h"
+#include "macros.h"
+
+static __thread ThreadCache thread_cache __attribute__ ((tls_model ("initial-exec")));
+
+// Key whose destructor flushes a thread's cache when it exits
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+// Max number of blocks cached for a bin.
+static unsigned int tcache_limit(int bin_idx) {
+    size_t limit = TCACHE_MAX_BYTES / idx2class(bin_idx);
+
+    if (limit > TCACHE_MAX_BLOCKS)
+        return TCACHE_MAX_BLOCKS;
+    return limit > 0 ? limit : 1;
+}
+
+// Number of blocks moved between the cache and the heap at once.
+static unsigned int tcache_batch(int bin_idx) {
+    return (tcache_limit(bin_idx) + 1) / 2;
+}
+
+// Flush the oldest blocks of a bin back to their heaps, keeping the most recently freed ones.
+static void tcache_flush(ThreadCache* cache, int bin_idx, unsigned int keep) {
+    FreeBlock** cut = &cache->bins[bin_idx];
+    for (unsigned int i = 0; i < keep; i++)
+        cut = &(*cut)->next;
+
+    FreeBlock* list = *cut;
+    *cut = NULL;
+    cache->counts[bin_idx] = keep;
+
+    DPRINT("  Flushing thread cache bin %d down to %u blocks", bin_idx, keep);
+    heap_free_batch(list, bin_idx, &cache->pending[bin_idx]);
+}
+
+// Runs when a thread exits: flush every bin, then release the thread's heap.
+static void tcache_destroy(void* arg) {
+    ThreadCache* cache = arg;
+    DPRINT("Thread exiting, flushing its cache");
+
+    cache->disabled = true;
+    for (int b = 0; b < NUM_SIZE_BINS; b++) {
+        if (cache->counts[b] > 0 || cache->pending[b].allocs > 0 || cache->pending[b].frees > 0)
+            tcache_flush(cache, b, 0);
+    }
+
+    heap_thread_exit(get_thread_heap());
+}
+
+static void tcache_create_key() {
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+static void tcache_register(ThreadCache* cache) {
+    // Set first: pthread_setspecific may itself allocate.
+    cache->registered = true;
+    pthread_once(&tcache_key_once, tcache_create_key);
+    pthread_setspecific(tcache_key, cache);
+}
+
+static void* tcache_refill(ThreadCache* cache, int bin_idx) {
+    if (!cache->registered)
+        tcache_register(cache);
+
+    // Once the thread is exiting, hand out blocks one at a time without caching any.
+    unsigned int batch = cache->disabled ? 1 : tcache_batch(bin_idx);
+
+    FreeBlock* list;
+    unsigned int count = heap_alloc_batch(get_thread_heap(), bin_idx, batch, &list, &cache->pending[bin_idx]);
+    if (count == 0)
+        return NULL;
+
+    DPRINT("  Refilled thread cache bin %d with %u blocks", bin_idx, count);
+
+    // Hand out the first block, keep the rest.
+    cache->bins[bin_idx] = list->next;
+    cache->counts[bin_idx] = count - 1;
+    cache->pending[bin_idx].allocs++;
+    return list;
+}
+
+void* tcache_alloc(int bin_idx) {
+    ThreadCache* cache = &thread_cache;
+    FreeBlock* block = cache->bins[bin_idx];
+
+    if (block == NULL)
+        return tcache_refill(cache, bin_idx);
+
+    cache->bins[bin_idx] = block->next;
+    cache->counts[bin_idx]--;
+    cache->pending[bin_idx].allocs++;
+    return block;
+}
+
+void* tcache_calloc(int bin_idx, size_t size) {
+    ThreadCache* cache = &thread_cache;
+
+    // Cached blocks have all been used. With none cached, a large block may come from the heap already zero.
+    if (cache->bins[bin_idx] == NULL && idx2class(bin_idx) >= CALLOC_HEAP_MIN_SIZE)
+        return heap_calloc(get_thread_heap(), bin_idx, size);
+
+    void* ptr = tcache_alloc(bin_idx);
+    if (ptr != NULL)
+        memset(ptr, 0, size);
+    return ptr;
+}
+
+void tcache_free(void* ptr) {
+    tcache_free_idx(ptr, size2idx(get_block_size(ptr)));
+}
+
+void tcache_free_idx(void* ptr, int bin_idx) {
+    // Not the start of a block: an invalid or interior pointer, left alone
+    if ((uintptr_t) ptr & (MIN_BLOCK_SIZE - 1)) {
+        DPRINT("Cannot free misaligned pointer %p", ptr);
+        return;
+    }
+
+    // A thread that only frees must still flush its cache at exit
+    ThreadCache* cache = &thread_cache;
+    if (!cache->registered)
+        tcache_register(cache);
+    ASSERT(idx2class(bin_idx) == GET_SUPERBLOCK(ptr)->header.block_size);
+
+    FreeBlock* block = ptr;
+    block->next = cache->bins[bin_idx];
+    cache->bins[bin_idx] = block;
+    cache->pending[bin_idx].frees++;
+
+    if (++cache->counts[bin_idx] > tcache_limit(bin_idx) || cache->disabled)
+        tcache_flush(cache, bin_idx, cache->disabled ? 0 : tcache_limit(bin_idx) - tcache_batch(bin_idx));
+}
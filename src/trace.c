@@ -0,0 +1,188 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "macros.h"
+#include "trace.h"
+
+// Each thread owns a ring buffer that only it appends to, publishing events by advancing head. Flushing
+// takes trace_mutex, writes out every buffer's events from tail to head and advances tail, so a buffer
+// has one producer and one consumer and needs no lock. Buffers are mmap'd and kept on a list that only
+// grows; the buffer of a thread that exited is handed to the next new thread, after its remaining events.
+
+#define TRACE_BUFFER_EVENTS (1 << LG_TRACE_BUFFER_EVENTS)
+
+typedef struct trace_buffer {
+    struct trace_buffer* next;
+    atomic_bool in_use;  // Owned by a live thread
+    _Atomic uint64_t head;  // Events appended
+    _Atomic uint64_t tail;  // Events written out
+    TraceEvent events[TRACE_BUFFER_EVENTS];
+} TraceBuffer;
+
+bool trace_enabled;
+
+static int trace_fd = -1;
+static struct timespec trace_start;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static TraceBuffer* _Atomic trace_buffers;
+static atomic_uint trace_next_thread;
+
+static __thread TraceBuffer* trace_buffer __attribute__ ((tls_model ("initial-exec")));
+static __thread uint32_t trace_thread __attribute__ ((tls_model ("initial-exec")));  // Id + 1, 0 if none yet
+
+// Key whose destructor releases a thread's buffer when it exits
+static pthread_key_t trace_key;
+
+// Write out len bytes, retrying short writes. Errors drop the events; there is nobody to report them to.
+static void write_all(const void* buf, size_t len) {
+    const char* p = buf;
+    while (len > 0) {
+        ssize_t written = write(trace_fd, p, len);
+        if (written <= 0)
+            return;
+        p += written;
+        len -= written;
+    }
+}
+
+// Write out the buffered events of every thread.
+static void trace_flush() {
+    pthread_mutex_lock(&trace_mutex);
+    for (TraceBuffer* buffer = atomic_load(&trace_buffers); buffer != NULL; buffer = buffer->next) {
+        uint64_t tail = atomic_load_explicit(&buffer->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+
+        // The events may wrap around the end of the ring
+        while (tail != head) {
+            uint64_t start = tail & (TRACE_BUFFER_EVENTS - 1);
+            uint64_t count = head - tail;
+            if (start + count > TRACE_BUFFER_EVENTS)
+                count = TRACE_BUFFER_EVENTS - start;
+
+            write_all(&buffer->events[start], count * sizeof(TraceEvent));
+            tail += count;
+        }
+        atomic_store_explicit(&buffer->tail, tail, memory_order_release);
+    }
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+static void trace_thread_exit(void* arg) {
+    TraceBuffer* buffer = arg;
+    trace_buffer = NULL;
+    atomic_store_explicit(&buffer->in_use, false, memory_order_release);
+}
+
+// Take over the buffer of an exited thread, or map a new one.
+static TraceBuffer* trace_attach() {
+    TraceBuffer* buffer;
+    for (buffer = atomic_load(&trace_buffers); buffer != NULL; buffer = buffer->next) {
+        bool expected = false;
+        if (!atomic_load_explicit(&buffer->in_use, memory_order_relaxed) &&
+            atomic_compare_exchange_strong(&buffer->in_use, &expected, true))
+            break;
+    }
+
+    if (buffer == NULL) {
+        buffer = mmap(NULL, sizeof(TraceBuffer), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED)
+            return NULL;
+
+        buffer->in_use = true;
+        buffer->next = atomic_load(&trace_buffers);
+        while (!atomic_compare_exchange_weak(&trace_buffers, &buffer->next, buffer));
+    }
+
+    // Frees by later thread destructors attach again, keeping the id
+    if (trace_thread == 0)
+        trace_thread = atomic_fetch_add(&trace_next_thread, 1) + 1;
+    trace_buffer = buffer;
+    pthread_setspecific(trace_key, buffer);
+    return buffer;
+}
+
+void trace_record(TraceOp op, void* ptr, size_t size, uintptr_t arg) {
+    // Failed allocations change nothing a replay could repeat. A realloc to size 0 is a free, though.
+    if (ptr == NULL && (op != TRACE_REALLOC || arg == 0))
+        return;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    TraceBuffer* buffer = trace_buffer;
+    if (buffer == NULL && (buffer = trace_attach()) == NULL)
+        return;
+
+    uint64_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&buffer->tail, memory_order_acquire) == TRACE_BUFFER_EVENTS)
+        trace_flush();
+
+    TraceEvent* event = &buffer->events[head & (TRACE_BUFFER_EVENTS - 1)];
+    event->time = (ts.tv_sec - trace_start.tv_sec) * 1000000000ULL + ts.tv_nsec - trace_start.tv_nsec;
+    event->ptr = (uintptr_t) ptr;
+    event->size = size;
+    event->arg = arg;
+    event->thread = trace_thread - 1;
+    event->op = op;
+    atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
+}
+
+static void* background_flush(void* arg) {
+    (void) arg;
+    struct timespec ts = {
+        .tv_sec = TRACE_FLUSH_INTERVAL_MS / 1000, .tv_nsec = (TRACE_FLUSH_INTERVAL_MS % 1000) * 1000000
+    };
+
+    while (1) {
+        nanosleep(&ts, NULL);
+        trace_flush();
+    }
+    return NULL;
+}
+
+// A child would interleave its events with the parent's in the same file
+static void trace_disable_in_child() {
+    trace_enabled = false;
+}
+
+__attribute__ ((destructor))
+static void trace_flush_at_exit() {
+    if (!trace_enabled)
+        return;
+
+    // Frees after this point are not recorded
+    trace_enabled = false;
+    trace_flush();
+}
+
+__attribute__ ((constructor))
+static void init_trace() {
+    const char* path = getenv("MYMALLOC_TRACE");
+    if (path == NULL || *path == '\0')
+        return;
+
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        perror("mymalloc: cannot open trace file");
+        return;
+    }
+
+    TraceHeader header = { .magic = TRACE_MAGIC, .version = TRACE_VERSION, .event_size = sizeof(TraceEvent) };
+    write_all(&header, sizeof(header));
+
+    pthread_key_create(&trace_key, trace_thread_exit);
+    pthread_atfork(NULL, NULL, trace_disable_in_child);
+    clock_gettime(CLOCK_MONOTONIC, &trace_start);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, background_flush, NULL) == 0)
+        pthread_detach(thread);
+
+    DPRINT("Tracing allocations to %s", path);
+    trace_enabled = true;
+}
@@ -0,0 +1,107 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "binmanager.h"
+#include "check.h"
+#include "decay.h"
+#include "heap.h"
+#include "span.h"
+
+// calloc skips clearing memory it knows to be zero: blocks past a superblock's zero_start, purged superblocks
+// and spans, fresh mappings. Memory some other allocation dirtied must still come back zeroed, whether
+// calloc takes it from a recycled superblock, a purged one or a reused span.
+
+#define NUM_DIRTY 200
+#define MAX_BLOCKS 1024
+
+static size_t dirty_size;
+static char* dirty[NUM_DIRTY];
+static char* blocks[MAX_BLOCKS];  // Static, so that allocating it does not take the dirtied memory
+
+// Allocate and dirty blocks of dirty_size, free them and exit, which hands the thread's empty superblocks
+// and cached spans back for reuse by other threads
+static void* dirty_and_exit(void* arg) {
+    (void) arg;
+    for (int i = 0; i < NUM_DIRTY; i++) {
+        dirty[i] = malloc(dirty_size);
+        CHECK(dirty[i] != NULL);
+        memset(dirty[i], 0xAB, dirty_size);
+    }
+    for (int i = 0; i < NUM_DIRTY; i++)
+        free(dirty[i]);
+    return NULL;
+}
+
+static void run_dirty_thread(size_t size) {
+    dirty_size = size;
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, dirty_and_exit, NULL) == 0);
+    CHECK(pthread_join(thread, NULL) == 0);
+}
+
+static int is_zero(const char* ptr, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (ptr[i] != 0)
+            return 0;
+    }
+    return 1;
+}
+
+// Whether ptr lies in memory the dirty thread used
+static int reuses_dirty(char* ptr, size_t region) {
+    for (int i = 0; i < NUM_DIRTY; i++) {
+        uintptr_t start = (uintptr_t) dirty[i] & ~(region - 1);
+        if ((uintptr_t) ptr >= start && (uintptr_t) ptr < start + region)
+            return 1;
+    }
+    return 0;
+}
+
+// calloc blocks of size until they have covered the memory the dirty thread used, checking each is zero.
+// Returns whether any of them reused that memory.
+static int calloc_over_dirty(size_t size, size_t region) {
+    size_t count = NUM_DIRTY * dirty_size / size + NUM_DIRTY;
+    CHECK(count <= MAX_BLOCKS);
+
+    int reused = 0;
+    for (size_t i = 0; i < count; i++) {
+        blocks[i] = calloc(1, size);
+        CHECK(blocks[i] != NULL);
+        CHECK(is_zero(blocks[i], size));
+        reused |= reuses_dirty(blocks[i], region);
+    }
+
+    for (size_t i = 0; i < count; i++)
+        free(blocks[i]);
+    return reused;
+}
+
+static void check_calloc_after_dirty(size_t dirty_block, size_t calloc_block, size_t region, int purge) {
+    run_dirty_thread(dirty_block);
+    if (purge) {
+        purge_all_heaps();
+        purge_span_pool();
+    }
+    CHECK(calloc_over_dirty(calloc_block, region));
+}
+
+int main() {
+    // Blocks from the thread cache, which are always cleared
+    check_calloc_after_dirty(100, 100, SUPERBLOCK_SIZE, 0);
+
+    // Recycled superblocks, reset to another size class: dirty up to their old reap position, zero after it
+    check_calloc_after_dirty(5000, 7000, SUPERBLOCK_SIZE, 0);
+    check_calloc_after_dirty(7000, 20000, SUPERBLOCK_SIZE, 0);
+
+    // Spans reused from the shared spans without purging
+    check_calloc_after_dirty(MAX_BLOCK_SIZE + 1, 3 * PAGE_SIZE + MAX_BLOCK_SIZE, SEGMENT_SIZE, 0);
+
+    // Purged superblocks and spans, which calloc may take as zero
+    decay_ms = 0;
+    check_calloc_after_dirty(9000, 12000, SUPERBLOCK_SIZE, 1);
+    check_calloc_after_dirty(2 * MAX_BLOCK_SIZE, MAX_BLOCK_SIZE + PAGE_SIZE, SEGMENT_SIZE, 1);
+
+    printf("calloc_test passed\n");
+    return 0;
+}
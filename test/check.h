@@ -0,0 +1,32 @@
+#ifndef MYMALLOC_TEST_CHECK_H
+#define MYMALLOC_TEST_CHECK_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Checks for the focused tests: each failure names its line and exits with status 1.
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        exit(1); \
+    } \
+} while (0)
+
+// Fill size bytes with a pattern depending on seed, which check_pattern verifies.
+static inline void fill_pattern(void* ptr, size_t size, unsigned int seed) {
+    unsigned char* bytes = ptr;
+    for (size_t i = 0; i < size; i++)
+        bytes[i] = (unsigned char) (i * 31 + seed);
+}
+
+static inline int check_pattern(const void* ptr, size_t size, unsigned int seed) {
+    const unsigned char* bytes = ptr;
+    for (size_t i = 0; i < size; i++) {
+        if (bytes[i] != (unsigned char) (i * 31 + seed))
+            return 0;
+    }
+    return 1;
+}
+
+#endif //MYMALLOC_TEST_CHECK_H
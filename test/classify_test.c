@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "binmanager.h"
+#include "check.h"
+#include "pagemap.h"
+
+// classify_ptr tells blocks, spans and large allocations apart from memory we did not allocate, including
+// pointers into the middle of an allocation. free and realloc leave foreign pointers alone.
+
+static int global_object;
+
+int main() {
+    int stack_object;
+    CHECK(classify_ptr(&stack_object) == ALLOC_FOREIGN);
+    CHECK(classify_ptr(&global_object) == ALLOC_FOREIGN);
+    CHECK(classify_ptr((void*) main) == ALLOC_FOREIGN);
+    CHECK(classify_ptr((void*) (uintptr_t) -PAGE_SIZE) == ALLOC_FOREIGN);  // Past the address space
+
+    // A page-aligned mapping of someone else's, the same shape as a large allocation
+    size_t mapping_size = SPAN_MAX_SIZE + PAGE_SIZE;
+    char* mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    CHECK(mapping != MAP_FAILED);
+    CHECK(classify_ptr(mapping) == ALLOC_FOREIGN);
+    CHECK(classify_ptr(mapping + PAGE_SIZE) == ALLOC_FOREIGN);
+
+    // Blocks and spans are known by their segment, at any offset
+    char* small = malloc(100);
+    CHECK(small != NULL);
+    CHECK(classify_ptr(small) == ALLOC_SMALL && classify_ptr(small + 50) == ALLOC_SMALL);
+
+    char* span = malloc(MAX_BLOCK_SIZE + 1);
+    CHECK(span != NULL);
+    CHECK(classify_ptr(span) == ALLOC_SPAN && classify_ptr(span + PAGE_SIZE + 8) == ALLOC_SPAN);
+
+    // Large allocations only by their first page
+    char* large = malloc(SPAN_MAX_SIZE + 1);
+    CHECK(large != NULL);
+    CHECK(classify_ptr(large) == ALLOC_LARGE);
+    CHECK(classify_ptr(large + 16) == ALLOC_FOREIGN);
+    CHECK(classify_ptr(large + PAGE_SIZE) == ALLOC_FOREIGN);
+
+    // Freeing or reallocating foreign pointers does nothing
+    mapping[0] = 'f';
+    free(mapping);
+    CHECK(realloc(mapping, 100) == NULL);
+    CHECK(mapping[0] == 'f' && classify_ptr(mapping) == ALLOC_FOREIGN);
+
+    // A freed large allocation is no longer ours, whether it is cached or unmapped
+    free(large);
+    CHECK(classify_ptr(large) == ALLOC_FOREIGN);
+
+    free(span);
+    free(small);
+    munmap(mapping, mapping_size);
+
+    printf("classify_test passed\n");
+    return 0;
+}
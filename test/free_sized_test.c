@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "binmanager.h"
+#include "check.h"
+#include "mymalloc.h"
+
+// free_sized and free_aligned_sized return every allocation to the size class, span or mapping malloc
+// and aligned_alloc took it from, at both ends of every class, and leave pointers we did not allocate alone.
+
+#define MB ((size_t) 1 << 20)
+
+static size_t read_stat(const char* name) {
+    size_t value;
+    CHECK(mymalloc_stat(name, &value) == 0);
+    return value;
+}
+
+// Free an allocation of size with free_sized, then allocate reuse_size: the thread cache, the heap's spans
+// or the large cache hand the same memory back if it went to the right place.
+static void check_reused(size_t size, size_t reuse_size) {
+    char* ptr = malloc(size);
+    CHECK(ptr != NULL && malloc_usable_size(ptr) >= size);
+    fill_pattern(ptr, size < 4096 ? size : 4096, 1);
+    free_sized(ptr, size);
+
+    char* again = malloc(reuse_size);
+    CHECK(again == ptr);
+    free(again);
+}
+
+int main() {
+    // Both ends of every size class
+    for (int idx = 0; idx < NUM_SIZE_BINS; idx++) {
+        size_t first = idx > 0 ? size_table[idx - 1] + 1 : 1;
+        check_reused(first, size_table[idx]);
+        check_reused(size_table[idx], first);
+    }
+
+    // Spans and large mappings, either side of their limits
+    check_reused(MAX_BLOCK_SIZE + 1, MAX_BLOCK_SIZE + 1);
+    check_reused(MB, MB);
+    check_reused(SPAN_MAX_SIZE + 1, SPAN_MAX_SIZE + 1);
+
+    size_t span_in_use = read_stat("heaps.span_in_use");
+    char* span = malloc(SPAN_MAX_SIZE);
+    CHECK(span != NULL && read_stat("heaps.span_in_use") == span_in_use + SPAN_MAX_SIZE);
+    free_sized(span, SPAN_MAX_SIZE);
+    CHECK(read_stat("heaps.span_in_use") == span_in_use);
+
+    // Aligned blocks come from the first class aligned enough, which free_aligned_sized finds again
+    size_t sizes[] = { 1, 100, 1000, 5000, MAX_BLOCK_SIZE, MB };
+    for (size_t alignment = 2 * MIN_BLOCK_SIZE; alignment <= 4 * PAGE_SIZE; alignment *= 2) {
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            size_t size = (sizes[i] + alignment - 1) & ~(alignment - 1);
+            char* ptr = aligned_alloc(alignment, size);
+            CHECK(ptr != NULL && ((uintptr_t) ptr & (alignment - 1)) == 0);
+            free_aligned_sized(ptr, alignment, size);
+
+            char* again = aligned_alloc(alignment, size);
+            CHECK(again == ptr);
+            free_aligned_sized(again, alignment, size);
+        }
+    }
+
+    // Memory we did not allocate is left alone, whatever size it is freed with
+    char* foreign = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    CHECK(foreign != MAP_FAILED);
+    fill_pattern(foreign, PAGE_SIZE, 2);
+    free_sized(foreign, 100);
+    free_sized(foreign, MB);
+    free_sized(foreign, SPAN_MAX_SIZE + 1);
+    free_aligned_sized(foreign, 64, 128);
+    free_aligned_sized(foreign, PAGE_SIZE, PAGE_SIZE);
+    CHECK(check_pattern(foreign, PAGE_SIZE, 2));
+    munmap(foreign, PAGE_SIZE);
+
+    printf("free_sized_test passed\n");
+    return 0;
+}
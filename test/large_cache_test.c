@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "check.h"
+#include "macros.h"
+#include "mymalloc.h"
+
+// Freed large mappings are cached and handed out again, to the same size or a smaller one in the same bin.
+
+#define MB ((size_t) 1 << 20)
+
+static size_t read_stat(const char* name) {
+    size_t value;
+    CHECK(mymalloc_stat(name, &value) == 0);
+    return value;
+}
+
+int main() {
+    size_t size = 64 * MB;
+    char* ptr = malloc(size);
+    CHECK(ptr != NULL);
+    fill_pattern(ptr, size, 1);
+
+    size_t cached = read_stat("large.cached");
+    free(ptr);
+    CHECK(read_stat("large.cached") == cached + size);
+
+    // The same size reuses the mapping
+    char* again = malloc(size);
+    CHECK(again == ptr);
+    CHECK(read_stat("large.cached") == cached);
+
+    // So does a slightly smaller one, giving the excess pages back
+    free(again);
+    again = malloc(size - 4 * PAGE_SIZE);
+    CHECK(again == ptr);
+    CHECK(read_stat("large.cached") == cached);
+    CHECK(read_stat("large.in_use") >= size - 4 * PAGE_SIZE);
+
+    // A larger size needs a new mapping and leaves the cache alone
+    free(again);
+    char* larger = malloc(2 * size);
+    CHECK(larger != NULL && larger != ptr);
+    CHECK(read_stat("large.cached") == cached + size - 4 * PAGE_SIZE);
+    fill_pattern(larger, 2 * size, 2);
+    free(larger);
+
+    // calloc on a reused mapping clears what the previous owner wrote
+    char* zeroed = calloc(1, size - 4 * PAGE_SIZE);
+    CHECK(zeroed == ptr);
+    for (size_t i = 0; i < size - 4 * PAGE_SIZE; i += 4096)
+        CHECK(zeroed[i] == 0);
+    free(zeroed);
+
+    printf("large_cache_test passed\n");
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include <errno.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "binmanager.h"
+#include "check.h"
+#include "mymalloc.h"
+
+// posix_memalign, aligned_alloc, memalign, valloc and pvalloc: alignment of the results over every
+// allocator, and their EINVAL and ENOMEM contracts.
+
+#define MB ((size_t) 1 << 20)
+
+// Too large for any allocation, and opaque to the compiler's size checks
+static volatile size_t too_large = SIZE_MAX - 100;
+
+static int is_aligned(void* ptr, size_t alignment) {
+    return ((uintptr_t) ptr & (alignment - 1)) == 0;
+}
+
+// Allocate, check alignment and usable size, write all of it, free with free() or free_aligned_sized()
+static void check_aligned(size_t alignment, size_t size, int sized) {
+    void* ptr = (void*) 1;
+    CHECK(posix_memalign(&ptr, alignment, size) == 0);
+    CHECK(ptr != NULL && is_aligned(ptr, alignment));
+    CHECK(malloc_usable_size(ptr) >= size);
+    fill_pattern(ptr, size, (unsigned int) alignment);
+    CHECK(check_pattern(ptr, size, (unsigned int) alignment));
+    if (sized)
+        free_aligned_sized(ptr, alignment, size);
+    else
+        free(ptr);
+
+    ptr = aligned_alloc(alignment, size);
+    CHECK(ptr != NULL && is_aligned(ptr, alignment));
+    fill_pattern(ptr, size, 7);
+    free(ptr);
+
+    ptr = memalign(alignment, size);
+    CHECK(ptr != NULL && is_aligned(ptr, alignment));
+    fill_pattern(ptr, size, 9);
+    sized ? free_aligned_sized(ptr, alignment, size) : free(ptr);
+}
+
+int main() {
+    // Small blocks, spans and large mappings, up to alignments past what spans support
+    size_t sizes[] = { 1, 8, 100, 1000, 4096, 5000, MAX_BLOCK_SIZE, MAX_BLOCK_SIZE + 1, MB, SPAN_MAX_SIZE + 1 };
+    for (size_t alignment = sizeof(void*); alignment <= 4 * SPAN_MAX_ALIGNMENT; alignment *= 2) {
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            check_aligned(alignment, sizes[i], 0);
+            check_aligned(alignment, sizes[i], 1);
+        }
+    }
+
+    // posix_memalign: alignments that are not a power of two multiple of sizeof(void*)
+    void* ptr = (void*) 1;
+    size_t bad_alignments[] = { 0, 1, 2, 4, 12, 24, 48, 100, SIZE_MAX };
+    for (size_t i = 0; i < sizeof(bad_alignments) / sizeof(bad_alignments[0]); i++) {
+        CHECK(posix_memalign(&ptr, bad_alignments[i], 16) == EINVAL);
+        CHECK(ptr == (void*) 1);  // Left alone on failure
+    }
+    CHECK(posix_memalign(&ptr, 64, too_large) == ENOMEM && ptr == (void*) 1);
+    CHECK(posix_memalign(&ptr, MB, SIZE_MAX / 2) == ENOMEM && ptr == (void*) 1);
+
+    // Size 0 gives NULL or a pointer free() accepts
+    CHECK(posix_memalign(&ptr, 64, 0) == 0);
+    free(ptr);
+
+    // aligned_alloc: alignment must be a power of two
+    errno = 0;
+    CHECK(aligned_alloc(24, 48) == NULL && errno == EINVAL);
+    errno = 0;
+    CHECK(aligned_alloc(0, 48) == NULL && errno == EINVAL);
+    errno = 0;
+    CHECK(aligned_alloc(64, too_large) == NULL && errno == ENOMEM);
+
+    // memalign rounds other alignments up to a power of two, but not past the largest one
+    ptr = memalign(24, 100);
+    CHECK(ptr != NULL && is_aligned(ptr, 32));
+    free(ptr);
+    ptr = memalign(3000, 100);
+    CHECK(ptr != NULL && is_aligned(ptr, 4096));
+    free(ptr);
+    errno = 0;
+    CHECK(memalign(SIZE_MAX, 100) == NULL && errno == EINVAL);
+    errno = 0;
+    CHECK(memalign(64, too_large) == NULL && errno == ENOMEM);
+
+    // valloc and pvalloc: page-aligned, pvalloc rounding the size up to whole pages
+    ptr = valloc(100);
+    CHECK(ptr != NULL && is_aligned(ptr, PAGE_SIZE));
+    free(ptr);
+    ptr = pvalloc(1);
+    CHECK(ptr != NULL && is_aligned(ptr, PAGE_SIZE) && malloc_usable_size(ptr) >= PAGE_SIZE);
+    fill_pattern(ptr, PAGE_SIZE, 3);
+    free(ptr);
+    ptr = pvalloc(0);
+    CHECK(ptr != NULL && is_aligned(ptr, PAGE_SIZE) && malloc_usable_size(ptr) >= PAGE_SIZE);
+    free(ptr);
+    errno = 0;
+    CHECK(pvalloc(too_large) == NULL && errno == ENOMEM);
+    errno = 0;
+    CHECK(valloc(too_large) == NULL && errno == ENOMEM);
+
+    printf("memalign_test passed\n");
+    return 0;
+}
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "check.h"
+#include "macros.h"
+
+// Large allocations grow and shrink with mremap, in place or moved by the kernel, keeping their contents.
+
+#define MB ((size_t) 1 << 20)
+
+int main() {
+    // Grow a large allocation a few times, then shrink it
+    size_t sizes[] = { SPAN_MAX_SIZE + 1, 48 * MB, 96 * MB + 123, 200 * MB, 40 * MB, SPAN_MAX_SIZE + 4097 };
+    size_t num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+
+    char* ptr = malloc(sizes[0]);
+    CHECK(ptr != NULL);
+    fill_pattern(ptr, sizes[0], 1);
+    size_t live = sizes[0];
+
+    for (size_t i = 1; i < num_sizes; i++) {
+        // A neighbour makes growing in place fail at least sometimes, so the kernel has to move the pages
+        char* neighbour = malloc(SPAN_MAX_SIZE + 1);
+        CHECK(neighbour != NULL);
+
+        ptr = realloc(ptr, sizes[i]);
+        CHECK(ptr != NULL);
+        size_t kept = live < sizes[i] ? live : sizes[i];
+        CHECK(check_pattern(ptr, kept, 1));
+
+        // The new tail is writable
+        fill_pattern(ptr, sizes[i], 1);
+        live = sizes[i];
+        free(neighbour);
+    }
+    free(ptr);
+
+    // A page-sized change within the same page count keeps the pointer
+    ptr = malloc(64 * MB);
+    CHECK(ptr != NULL);
+    fill_pattern(ptr, 64 * MB, 2);
+    CHECK(realloc(ptr, 64 * MB - 100) == ptr);
+    CHECK(check_pattern(ptr, 64 * MB - 100, 2));
+    free(ptr);
+
+    // Moving between spans and large mappings copies the contents
+    ptr = malloc(MB);
+    CHECK(ptr != NULL);
+    fill_pattern(ptr, MB, 3);
+    ptr = realloc(ptr, 64 * MB);
+    CHECK(ptr != NULL && check_pattern(ptr, MB, 3));
+    ptr = realloc(ptr, MB / 2);
+    CHECK(ptr != NULL && check_pattern(ptr, MB / 2, 3));
+    free(ptr);
+
+    printf("mremap_test passed\n");
+    return 0;
+}
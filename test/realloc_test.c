@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "binmanager.h"
+#include "check.h"
+#include "mymalloc.h"
+#include "span.h"
+
+// realloc keeps a block in place while the new size stays in its size class, and moves it with its contents
+// to another class otherwise, smaller ones included so that free_sized can find the class from the size.
+// Spans likewise stay in place within their page class.
+
+#define MB ((size_t) 1 << 20)
+
+int main() {
+    for (int idx = 0; idx < NUM_SIZE_BINS; idx++) {
+        size_t first = idx > 0 ? size_table[idx - 1] + 1 : 1;
+        size_t last = size_table[idx];
+
+        char* ptr = malloc(first);
+        CHECK(ptr != NULL);
+        fill_pattern(ptr, first, idx);
+
+        // Anywhere within the class
+        CHECK(realloc(ptr, last) == ptr);
+        CHECK(check_pattern(ptr, first, idx));
+        fill_pattern(ptr, last, idx);
+        CHECK(realloc(ptr, first) == ptr);
+        CHECK(check_pattern(ptr, first, idx));
+
+        // Into the next class, or a span after the last one
+        char* grown = realloc(ptr, last + 1);
+        CHECK(grown != NULL && grown != ptr);
+        CHECK(check_pattern(grown, first, idx));
+        CHECK(malloc_usable_size(grown) >= last + 1);
+
+        // Back down into the original class
+        char* shrunk = realloc(grown, first);
+        CHECK(shrunk != NULL && shrunk != grown);
+        CHECK(check_pattern(shrunk, first, idx));
+        CHECK(malloc_usable_size(shrunk) == last);
+        free(shrunk);
+    }
+
+    // Spans stay in place within their page class
+    size_t pages;
+    size_t size = MAX_BLOCK_SIZE + 1;
+    get_span_class(size, &pages);
+    char* span = malloc(size);
+    CHECK(span != NULL);
+    fill_pattern(span, size, 1);
+    CHECK(realloc(span, pages * PAGE_SIZE) == span);
+    CHECK(realloc(span, size) == span);
+    CHECK(check_pattern(span, size, 1));
+
+    // and move between page classes
+    char* moved = realloc(span, pages * PAGE_SIZE + 1);
+    CHECK(moved != NULL && moved != span);
+    CHECK(check_pattern(moved, size, 1));
+    moved = realloc(moved, MB);
+    CHECK(moved != NULL && check_pattern(moved, size, 1));
+    char* small = realloc(moved, 100);
+    CHECK(small != NULL && check_pattern(small, 100, 1));
+    CHECK(malloc_usable_size(small) == size_table[size2idx(100)]);
+
+    // Size 0 frees, NULL allocates
+    CHECK(realloc(small, 0) == NULL);
+    char* fresh = realloc(NULL, 100);
+    CHECK(fresh != NULL);
+    free(fresh);
+
+    printf("realloc_test passed\n");
+    return 0;
+}
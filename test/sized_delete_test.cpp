@@ -0,0 +1,47 @@
+#include <cstddef>
+#include <cstdio>
+#include <new>
+
+// A program that replaces the unsized operator new and delete gets its sized deletes through them too.
+// mymalloc must not implement sized delete on its own, or it would free memory from the program's pool.
+
+alignas(16) static char pool[1 << 16];
+static std::size_t pool_used;
+static int deletes;
+
+void* operator new(std::size_t size) {
+    size = (size + 15) & ~static_cast<std::size_t>(15);
+    if (pool_used + size > sizeof(pool))
+        throw std::bad_alloc();
+    void* ptr = pool + pool_used;
+    pool_used += size;
+    return ptr;
+}
+
+// Replaced without its sized form on purpose: defining that here would hide one exported by mymalloc
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wsized-deallocation"
+void operator delete(void* ptr) noexcept {
+    if (ptr != nullptr)
+        deletes++;
+}
+#pragma GCC diagnostic pop
+
+struct Object {
+    long values[5];
+};
+
+int main() {
+    Object* object = new Object();
+    delete object;  // Sized delete with -fsized-deallocation, the default since C++14
+
+    Object* objects = new Object[4];
+    delete[] objects;
+
+    if (deletes != 2) {
+        std::fprintf(stderr, "Expected 2 deletes through the replaced operator delete, got %d\n", deletes);
+        return 1;
+    }
+    std::printf("sized_delete_test passed\n");
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "check.h"
+#include "binmanager.h"
+#include "span.h"
+
+// Spans are split off free spans and merged with their free neighbours through the boundary tags
+// of their first and last pages.
+
+static char* page(char* ptr, size_t n) {
+    return ptr + n * PAGE_SIZE;
+}
+
+static uint32_t tag_at(char* ptr) {
+    return get_span_tag(ptr);
+}
+
+int main() {
+    size_t dirty;
+
+    // Consecutive spans are split off the free span of a new segment
+    char* a = span_pool_alloc(8, PAGE_SIZE, 3, &dirty);
+    char* b = span_pool_alloc(8, PAGE_SIZE, 3, &dirty);
+    char* c = span_pool_alloc(8, PAGE_SIZE, 3, &dirty);
+    CHECK(a != NULL && b == page(a, 8) && c == page(b, 8));
+
+    SpanSegment* segment = get_span_segment(a);
+    CHECK(segment->magic == SPAN_SEGMENT_MAGIC);
+    CHECK(a == (char*) segment + SPAN_HEADER_PAGES * PAGE_SIZE);
+    size_t segment_span_pages = SEGMENT_PAGES - SPAN_HEADER_PAGES;
+
+    // Both ends of an allocated span carry its size and owner, and the rest of the segment is one free span
+    CHECK(tag_at(a) == SPAN_TAG(8, 3) && tag_at(page(a, 7)) == SPAN_TAG(8, 3));
+    CHECK(tag_at(page(c, 8)) == (SPAN_TAG(segment_span_pages - 24, 0) | SPAN_FREE));
+    CHECK(tag_at(page(a, segment_span_pages - 1)) == (SPAN_TAG(segment_span_pages - 24, 0) | SPAN_FREE));
+
+    // A span between two allocated ones stays on its own
+    span_pool_free(b, 8);
+    CHECK(tag_at(b) == (SPAN_TAG(8, 0) | SPAN_FREE) && tag_at(page(b, 7)) == (SPAN_TAG(8, 0) | SPAN_FREE));
+
+    // Freeing its left neighbour merges the two
+    span_pool_free(a, 8);
+    CHECK(tag_at(a) == (SPAN_TAG(16, 0) | SPAN_FREE) && tag_at(page(a, 15)) == (SPAN_TAG(16, 0) | SPAN_FREE));
+
+    // Freeing the span between them and the rest of the segment merges all three
+    span_pool_free(c, 8);
+    CHECK(tag_at(a) == (SPAN_TAG(segment_span_pages, 0) | SPAN_FREE));
+    CHECK(tag_at(page(a, segment_span_pages - 1)) == (SPAN_TAG(segment_span_pages, 0) | SPAN_FREE));
+
+    // An aligned span leaves its leading pages free, and merges back with them
+    size_t alignment = (size_t) 64 << 10;
+    char* aligned = span_pool_alloc(4, alignment, 5, &dirty);
+    CHECK(aligned != NULL && ((uintptr_t) aligned & (alignment - 1)) == 0);
+    CHECK(get_span_segment(aligned) == segment);
+    size_t lead_pages = (aligned - a) >> LG_PAGE_SIZE;
+    CHECK(lead_pages > 0 && tag_at(a) == (SPAN_TAG(lead_pages, 0) | SPAN_FREE));
+    CHECK(tag_at(aligned) == SPAN_TAG(4, 5));
+
+    span_pool_free(aligned, 4);
+    CHECK(tag_at(a) == (SPAN_TAG(segment_span_pages, 0) | SPAN_FREE));
+
+    // Through malloc, medium sizes are spans, freed spans are reused by their heap
+    char* medium = malloc(MAX_BLOCK_SIZE + 1);
+    CHECK(medium != NULL && ((uintptr_t) medium & (PAGE_SIZE - 1)) == 0);
+    fill_pattern(medium, MAX_BLOCK_SIZE + 1, 1);
+    free(medium);
+    char* reused = malloc(MAX_BLOCK_SIZE + 1);
+    CHECK(reused == medium);
+    free(reused);
+
+    printf("span_test passed\n");
+    return 0;
+}
@@ -0,0 +1,98 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mymalloc.h"
+
+// A producer thread allocates and exits, then the main thread frees everything it allocated.
+// The superblocks the producer's heap kept at exit must not stay in use. Then consumer threads
+// free blocks the main thread allocated, and nothing else: their caches must be flushed at exit.
+
+#define NUM_OBJECTS 400000
+#define OBJECT_SIZE 200
+
+#define NUM_CONSUMERS 200
+#define CONSUMED_OBJECTS 32
+#define CONSUMED_SIZE 64
+#define DRAIN_SIZE 1000
+
+static char* objects[NUM_OBJECTS];
+static char* consumed[NUM_CONSUMERS][CONSUMED_OBJECTS];
+
+static void* produce(void* arg) {
+    (void) arg;
+    for (int i = 0; i < NUM_OBJECTS; i++) {
+        objects[i] = malloc(OBJECT_SIZE);
+        if (objects[i] == NULL) {
+            fprintf(stderr, "malloc failed\n");
+            exit(1);
+        }
+        memset(objects[i], 'p', OBJECT_SIZE);
+    }
+    return NULL;
+}
+
+static void* consume(void* arg) {
+    char** blocks = arg;
+    for (int i = 0; i < CONSUMED_OBJECTS; i++)
+        free(blocks[i]);
+    return NULL;
+}
+
+static size_t in_use() {
+    size_t heaps, global;
+    if (mymalloc_stat("heaps.in_use", &heaps) != 0 || mymalloc_stat("global.in_use", &global) != 0) {
+        fprintf(stderr, "mymalloc_stat failed\n");
+        exit(1);
+    }
+    return heaps + global;
+}
+
+int main() {
+    size_t before = in_use();
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, produce, NULL) != 0 || pthread_join(thread, NULL) != 0) {
+        fprintf(stderr, "Failed to run the producer thread\n");
+        return 1;
+    }
+
+    size_t produced = in_use();
+    for (int i = 0; i < NUM_OBJECTS; i++)
+        free(objects[i]);
+    size_t after = in_use();
+
+    printf("in use: %zu before, %zu after producing, %zu after freeing\n", before, produced, after);
+    if (after - before > (size_t) NUM_OBJECTS * OBJECT_SIZE / 20) {
+        fprintf(stderr, "Blocks freed after their thread exited are still in use\n");
+        return 1;
+    }
+
+    before = in_use();
+    for (int t = 0; t < NUM_CONSUMERS; t++) {
+        for (int i = 0; i < CONSUMED_OBJECTS; i++) {
+            if ((consumed[t][i] = malloc(CONSUMED_SIZE)) == NULL) {
+                fprintf(stderr, "malloc failed\n");
+                return 1;
+            }
+        }
+    }
+
+    for (int t = 0; t < NUM_CONSUMERS; t++) {
+        if (pthread_create(&thread, NULL, consume, consumed[t]) != 0 || pthread_join(thread, NULL) != 0) {
+            fprintf(stderr, "Failed to run a consumer thread\n");
+            return 1;
+        }
+    }
+
+    // Their frees reach the main thread's heap when it next refills its cache, from a bin not used yet
+    free(malloc(DRAIN_SIZE));
+    after = in_use();
+
+    printf("in use: %zu before, %zu after consuming\n", before, after);
+    if (after - before >= (size_t) NUM_CONSUMERS * CONSUMED_OBJECTS * CONSUMED_SIZE / 4) {
+        fprintf(stderr, "Blocks cached by threads that only freed are still in use\n");
+        return 1;
+    }
+    return 0;
+}
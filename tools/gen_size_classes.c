@@ -0,0 +1,143 @@
+// Generates the size class table at build time.
+// Usage: gen_size_classes <output header>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "macros.h"
+#include "superblock.h"
+
+#define SMALL_LOOKUP_MAX 1024  // Sizes up to this are looked up directly at MIN_BLOCK_SIZE granularity
+
+static size_t size_table[MAX_NUM_BINS];
+static int num_size_bins;
+
+static void add_size_class(size_t sz) {
+    if (num_size_bins == MAX_NUM_BINS) {
+        fprintf(stderr, "gen_size_classes: more than %d size classes\n", MAX_NUM_BINS);
+        exit(1);
+    }
+    size_table[num_size_bins++] = sz;
+}
+
+// Next size class after sz.
+static size_t next_size_class(size_t sz) {
+    size_t new_sz;
+
+#if SIZE_CLASSES_PER_DOUBLING > 0
+    // Equally spaced classes between consecutive powers of two
+    size_t pow2 = MIN_BLOCK_SIZE;
+    while (pow2 * 2 <= sz)
+        pow2 *= 2;
+    new_sz = sz + pow2 / SIZE_CLASSES_PER_DOUBLING;
+#else
+    new_sz = (size_t) ((double) sz * SIZE_RATIO);
+#endif
+
+    // Align
+    new_sz = new_sz & ~(MIN_BLOCK_SIZE - 1);
+    while (new_sz <= sz)
+        new_sz += MIN_BLOCK_SIZE;
+
+    return new_sz;
+}
+
+static void build_size_table() {
+    size_t half_sb = (SUPERBLOCK_SIZE - sizeof(SuperblockHeader)) / 2;
+    size_t sz = MIN_BLOCK_SIZE;
+    size_t pow2 = MIN_BLOCK_SIZE;
+
+    // Every power of two up to a page is a class too, so aligned allocations have naturally aligned blocks
+    while (sz <= half_sb) {
+        while (pow2 < sz && pow2 <= PAGE_SIZE) {
+            add_size_class(pow2);
+            pow2 *= 2;
+        }
+        if (pow2 == sz)
+            pow2 *= 2;
+
+        add_size_class(sz);
+        sz = next_size_class(sz);
+    }
+
+    // If maximum block size is not large enough, add one more
+    size_t max_block_size_threshold = (size_t) ((double) half_sb * MAX_BLOCK_SIZE_THRESHOLD_RATIO);
+    if (size_table[num_size_bins - 1] < max_block_size_threshold)
+        add_size_class(half_sb & ~(MIN_BLOCK_SIZE - 1));
+}
+
+// Index of the smallest size class that fits size.
+static int lookup(size_t size) {
+    int idx = 0;
+    while (size_table[idx] < size)
+        idx++;
+    return idx;
+}
+
+// Largest granule such that no granule above SMALL_LOOKUP_MAX contains two class boundaries.
+static int large_lookup_shift() {
+    size_t min_gap = SIZE_MAX;
+    for (int i = 1; i < num_size_bins; i++) {
+        size_t gap = size_table[i] - size_table[i - 1];
+        if (size_table[i - 1] >= SMALL_LOOKUP_MAX && gap < min_gap)
+            min_gap = gap;
+    }
+
+    int shift = LG_MIN_BLOCK_SIZE;
+    while (((size_t) 2 << shift) <= min_gap && ((size_t) 2 << shift) <= SMALL_LOOKUP_MAX)
+        shift++;
+    return shift;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <output header>\n", argv[0]);
+        return 1;
+    }
+
+    build_size_table();
+    size_t max_block_size = size_table[num_size_bins - 1];
+    if (2 * max_block_size + buffer_offset(max_block_size) > SUPERBLOCK_SIZE) {
+        fprintf(stderr, "gen_size_classes: two blocks of %zu bytes do not fit a superblock\n", max_block_size);
+        return 1;
+    }
+
+    FILE* out = fopen(argv[1], "w");
+    if (out == NULL) {
+        perror("gen_size_classes");
+        return 1;
+    }
+
+    fprintf(out, "// Generated by tools/gen_size_classes.c. Do not edit.\n");
+    fprintf(out, "#ifndef MYMALLOC_SIZE_CLASSES_H\n#define MYMALLOC_SIZE_CLASSES_H\n\n");
+    fprintf(out, "#define NUM_SIZE_BINS %d\n", num_size_bins);
+    fprintf(out, "#define MAX_BLOCK_SIZE %zu\n\n", max_block_size);
+
+    // Block size of each bin
+    fprintf(out, "#define SIZE_TABLE_INITIALIZER {");
+    for (int i = 0; i < num_size_bins; i++)
+        fprintf(out, "%s%s%zu", i == 0 ? "" : ",", i % 8 ? " " : " \\\n    ", size_table[i]);
+    fprintf(out, " \\\n}\n\n");
+
+    // Bin of each size up to SMALL_LOOKUP_MAX, indexed by (size + MIN_BLOCK_SIZE - 1) >> LG_MIN_BLOCK_SIZE
+    int num_small = (SMALL_LOOKUP_MAX >> LG_MIN_BLOCK_SIZE) + 1;
+    fprintf(out, "#define SMALL_LOOKUP_MAX %d\n", SMALL_LOOKUP_MAX);
+    fprintf(out, "#define SMALL_LOOKUP_SIZE %d\n", num_small);
+    fprintf(out, "#define SMALL_LOOKUP_INITIALIZER {");
+    for (int i = 0; i < num_small; i++)
+        fprintf(out, "%s%s%d", i == 0 ? "" : ",", i % 16 ? " " : " \\\n    ", lookup((size_t) i << LG_MIN_BLOCK_SIZE));
+    fprintf(out, " \\\n}\n\n");
+
+    // Bin of the smallest size in each granule above SMALL_LOOKUP_MAX, indexed by (size - 1) >> LARGE_LOOKUP_SHIFT.
+    // The next bin up is the only other candidate for sizes in the same granule.
+    int shift = large_lookup_shift();
+    int num_large = (int) ((max_block_size - 1) >> shift) + 1;
+    fprintf(out, "#define LARGE_LOOKUP_SHIFT %d\n", shift);
+    fprintf(out, "#define LARGE_LOOKUP_SIZE %d\n", num_large);
+    fprintf(out, "#define LARGE_LOOKUP_INITIALIZER {");
+    for (int i = 0; i < num_large; i++)
+        fprintf(out, "%s%s%d", i == 0 ? "" : ",", i % 16 ? " " : " \\\n    ", lookup(((size_t) i << shift) + 1));
+    fprintf(out, " \\\n}\n\n");
+
+    fprintf(out, "#endif //MYMALLOC_SIZE_CLASSES_H\n");
+    return fclose(out) == 0 ? 0 : 1;
+}